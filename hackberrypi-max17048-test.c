@@ -0,0 +1,419 @@
+/*
+ * KUnit tests for the HackberryPi CM5 MAX17048 fuel gauge driver.
+ *
+ * Built into the module by "make kunit", which includes this file at the
+ * end of hackberrypi-max17048.c so the static helpers are in scope. The
+ * suite runs when the module is loaded on a kernel with CONFIG_KUNIT, e.g.
+ *   sudo insmod hackberrypi-max17048.ko
+ *   cat /sys/kernel/debug/kunit/max17048/results
+ *
+ * The driver under test talks to the simulated gauge's in-memory regmap.
+ * A one-record replay holds the raw VCELL, SOC, CRATE and STATUS values
+ * each case sets, and the debugfs transaction counter shows how many bus
+ * reads a property query costs.
+ */
+
+#include <kunit/test.h>
+#include <linux/device.h>
+
+#if !IS_ENABLED(CONFIG_KUNIT)
+#error "The MAX17048 KUnit suite needs a kernel with CONFIG_KUNIT"
+#endif
+
+/* Older kunit_test_suite() defines module_init() itself */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+#error "The MAX17048 KUnit suite needs Linux 5.19 or later"
+#endif
+
+/**
+ * struct max17048_test - Per-case fixture
+ * @dev: Device owning the regmap and the devm allocations
+ * @rec: Raw measurement registers answered by the simulated gauge
+ * @sim: Simulated gauge replaying @rec
+ * @drv: Driver instance under test, never registered as a power supply
+ */
+struct max17048_test {
+  struct device *dev;
+  struct max17048_replay_rec rec;
+  struct max17048_sim sim;
+  struct max17048 drv;
+};
+
+static int max17048_test_init(struct kunit *test) {
+  struct max17048_test *ctx;
+  struct max17048 *drv;
+
+  ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+  KUNIT_ASSERT_NOT_NULL(test, ctx);
+  test->priv = ctx;
+
+  ctx->dev = root_device_register("max17048-test");
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->dev);
+
+  ctx->sim.rec = &ctx->rec;
+  ctx->sim.nrec = 1;
+  ctx->sim.dev = ctx->dev;
+
+  drv = &ctx->drv;
+  drv->dev = ctx->dev;
+  drv->sim = &ctx->sim;
+  drv->variant = &max17048_variant;
+  drv->regmap = devm_regmap_init(ctx->dev, NULL, &ctx->sim,
+                                 &max17048_sim_regmap_cfg);
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, drv->regmap);
+
+  max17048_setup_bus(drv);
+  KUNIT_ASSERT_EQ(test, max17048_read_config(drv), 0);
+  return 0;
+}
+
+static void max17048_test_exit(struct kunit *test) {
+  struct max17048_test *ctx = test->priv;
+
+  if (ctx && !IS_ERR_OR_NULL(ctx->dev))
+    root_device_unregister(ctx->dev);
+}
+
+/**
+ * max17048_test_set - Put raw measurements into the simulated gauge
+ * @test:  Test case
+ * @vcell: Raw VCELL
+ * @soc:   Raw SOC in 1/256 %
+ * @crate: Raw signed C-Rate
+ *
+ * Also forgets recently read values, so the next query goes to the bus.
+ */
+static struct max17048 *max17048_test_set(struct kunit *test, u16 vcell,
+                                          u16 soc, int16_t crate) {
+  struct max17048_test *ctx = test->priv;
+
+  ctx->rec.vcell = vcell;
+  ctx->rec.soc = soc;
+  ctx->rec.crate = (u16)crate;
+  ctx->rec.status = 0;
+  max17048_cache_expire(&ctx->drv);
+  return &ctx->drv;
+}
+
+/**
+ * max17048_test_get - Query a property and count the bus reads it took
+ * @test:  Test case
+ * @psp:   Property
+ * @xfers: Pointer to store the number of bus transactions
+ *
+ * Returns the property value; the query itself must succeed.
+ */
+static int max17048_test_get(struct kunit *test,
+                             enum power_supply_property psp, u64 *xfers) {
+  struct max17048_test *ctx = test->priv;
+  union power_supply_propval val = {};
+  u64 before = ctx->drv.stats.xfers;
+
+  KUNIT_EXPECT_EQ(test, max17048_get_property(&ctx->drv, psp, &val), 0);
+  if (xfers)
+    *xfers = ctx->drv.stats.xfers - before;
+  return val.intval;
+}
+
+static void max17048_test_vcell(struct kunit *test) {
+  struct max17048 *drv;
+
+  KUNIT_EXPECT_EQ(test, max17048_vcell_to_uv(0), 0);
+  KUNIT_EXPECT_EQ(test, max17048_vcell_to_uv(48640), 3800000);
+  KUNIT_EXPECT_EQ(test, max17048_vcell_to_uv(0xFFFF), 5119921);
+  KUNIT_EXPECT_EQ(test, max17049_vcell_to_uv(0xFFFF), 10239843);
+
+  drv = max17048_test_set(test, 48640, 50 << 8, 0);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_VOLTAGE_NOW, NULL),
+                  3800000);
+  KUNIT_EXPECT_EQ(test, max17048_get_vcell(drv), 3800000);
+}
+
+static void max17048_test_soc_over_full(struct kunit *test) {
+  struct max17048 *drv;
+
+  KUNIT_EXPECT_EQ(test, max17048_soc_to_pct(0), 0);
+  KUNIT_EXPECT_EQ(test, max17048_soc_to_pct((50 << 8) + 255), 50);
+  KUNIT_EXPECT_EQ(test, max17048_soc_to_pct(100 << 8), 100);
+  KUNIT_EXPECT_EQ(test, max17048_soc_to_pct(101 << 8), 100);
+  KUNIT_EXPECT_EQ(test, max17048_soc_to_pct(0xFFFF), 100);
+
+  /* A gauge reading above 100% after a charge reports a full battery */
+  drv = max17048_test_set(test, 54000, 0xFFFF, 0);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CAPACITY, NULL),
+                  100);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CHARGE_NOW, NULL),
+                  (int)max17048_charge_full(drv));
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_ENERGY_NOW, NULL),
+                  (int)max17048_energy_full(drv));
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+                                    NULL),
+                  POWER_SUPPLY_CAPACITY_LEVEL_FULL);
+}
+
+static void max17048_test_crate_extremes(struct kunit *test) {
+  struct max17048_tunables tun = {.tte_tuning_factor =
+                                      MAX17048_TTE_TUNING_FACTOR};
+  int val;
+
+  /* 0.208 %/hr per LSB of the largest supported capacity */
+  KUNIT_EXPECT_EQ(test, max17048_crate_scale(MAX17048_MAX_CAP_UAH, 32767),
+                  681553600);
+  KUNIT_EXPECT_EQ(test, max17048_crate_scale(MAX17048_MAX_CAP_UAH, -32767),
+                  -681553600);
+
+  max17048_test_set(test, 48640, 50 << 8, 32767);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CURRENT_NOW, NULL),
+                  340776800);
+  /* 225000 * (100 - 50) / (32767 * 13), truncated */
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
+                                    NULL),
+                  26);
+
+  max17048_test_set(test, 48640, 50 << 8, -32767);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CURRENT_NOW, NULL),
+                  -340776800);
+  /* No resistance estimate yet: 225000 * 50 * 8 / (32767 * 13) */
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
+                                    NULL),
+                  211);
+
+  /* No estimate without a clear direction */
+  KUNIT_EXPECT_EQ(test, max17048_tte_linear(&tun, 0, 50, &val), -ENODATA);
+  KUNIT_EXPECT_EQ(test, max17048_tte_linear(&tun, 32767, 50, &val), -ENODATA);
+  KUNIT_EXPECT_EQ(test, max17048_ttf_linear(0, 50, &val), -ENODATA);
+  KUNIT_EXPECT_EQ(test, max17048_ttf_linear(-32767, 50, &val), -ENODATA);
+  KUNIT_EXPECT_EQ(test, max17048_ttf_linear(32767, 100, &val), 0);
+  KUNIT_EXPECT_EQ(test, val, 0);
+}
+
+static void max17048_test_zero_capacity(struct kunit *test) {
+  struct max17048 *drv;
+
+  KUNIT_EXPECT_EQ(test, max17048_crate_scale(0, 32767), 0);
+  KUNIT_EXPECT_EQ(test, max17048_crate_scale(0, -32767), 0);
+
+  /* A restored capacity of 0 must not divide by zero anywhere */
+  drv = max17048_test_set(test, 48640, 50 << 8, -32767);
+  drv->learn.charge_full_uah = 0;
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CHARGE_FULL, NULL),
+                  0);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CHARGE_NOW, NULL),
+                  0);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_ENERGY_FULL, NULL),
+                  0);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CURRENT_NOW, NULL),
+                  0);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_ENERGY_NOW, NULL),
+                  0);
+}
+
+static void max17048_test_status(struct kunit *test) {
+  struct max17048_tunables tun = {.crate_noise_thr = MAX17048_CRATE_NOISE_THR,
+                                  .full_soc_thr = MAX17048_FULL_SOC_THR};
+  int thr = MAX17048_CRATE_NOISE_THR;
+  struct max17048 *drv;
+
+  KUNIT_EXPECT_EQ(test, max17048_decode_status(&tun, thr + 1, 50),
+                  POWER_SUPPLY_STATUS_CHARGING);
+  KUNIT_EXPECT_EQ(test, max17048_decode_status(&tun, -thr - 1, 50),
+                  POWER_SUPPLY_STATUS_DISCHARGING);
+  KUNIT_EXPECT_EQ(test, max17048_decode_status(&tun, thr, 50),
+                  POWER_SUPPLY_STATUS_NOT_CHARGING);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_decode_status(&tun, -thr, MAX17048_FULL_SOC_THR),
+                  POWER_SUPPLY_STATUS_FULL);
+
+  /* Near full and idle: charging with the adapter, FULL only once latched */
+  drv = max17048_test_set(test, 54000, 100 << 8, 0);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_NOT_CHARGING);
+  drv->ac_online = true;
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_CHARGING);
+  drv->full_latched = true;
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_FULL);
+  drv->ac_online = false;
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_NOT_CHARGING);
+
+  max17048_test_set(test, 48640, 50 << 8, -32767);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_DISCHARGING);
+}
+
+static void max17048_test_status_no_crate(struct kunit *test) {
+  struct max17048_sample sample = {.soc = 50 << 8};
+  struct max17048 *drv;
+
+  /* The MAX17043/44 have no CRATE: the adapter and the latch decide */
+  drv = max17048_test_set(test, 48640, 50 << 8, 0);
+  drv->variant = &max17043_variant;
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_DISCHARGING);
+  KUNIT_EXPECT_TRUE(test, max17048_should_notify(drv, &sample));
+  KUNIT_EXPECT_EQ(test, drv->notify_status, POWER_SUPPLY_STATUS_DISCHARGING);
+
+  drv->ac_online = true;
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_CHARGING);
+  KUNIT_EXPECT_TRUE(test, max17048_should_notify(drv, &sample));
+  KUNIT_EXPECT_EQ(test, drv->notify_status, POWER_SUPPLY_STATUS_CHARGING);
+
+  drv->full_latched = true;
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, NULL),
+                  POWER_SUPPLY_STATUS_FULL);
+  KUNIT_EXPECT_TRUE(test, max17048_should_notify(drv, &sample));
+  KUNIT_EXPECT_EQ(test, drv->notify_status, POWER_SUPPLY_STATUS_FULL);
+}
+
+static void max17048_test_capacity_level(struct kunit *test) {
+  int idle = POWER_SUPPLY_STATUS_NOT_CHARGING;
+
+  KUNIT_EXPECT_EQ(test, max17048_level_at(idle, 0),
+                  POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL);
+  KUNIT_EXPECT_EQ(test, max17048_level_at(idle, MAX17048_CAP_CRIT_THR),
+                  POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL);
+  KUNIT_EXPECT_EQ(test, max17048_level_at(idle, MAX17048_CAP_CRIT_THR + 1),
+                  POWER_SUPPLY_CAPACITY_LEVEL_LOW);
+  KUNIT_EXPECT_EQ(test, max17048_level_at(idle, MAX17048_CAP_LOW_THR),
+                  POWER_SUPPLY_CAPACITY_LEVEL_LOW);
+  KUNIT_EXPECT_EQ(test, max17048_level_at(idle, MAX17048_CAP_LOW_THR + 1),
+                  POWER_SUPPLY_CAPACITY_LEVEL_NORMAL);
+  KUNIT_EXPECT_EQ(test, max17048_level_at(idle, MAX17048_CAP_FULL_THR),
+                  POWER_SUPPLY_CAPACITY_LEVEL_FULL);
+  KUNIT_EXPECT_EQ(test, max17048_level_at(POWER_SUPPLY_STATUS_FULL, 50),
+                  POWER_SUPPLY_CAPACITY_LEVEL_FULL);
+
+  max17048_test_set(test, 44000, 3 << 8, -100);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+                                    NULL),
+                  max17048_level_at(POWER_SUPPLY_STATUS_DISCHARGING, 3));
+}
+
+static void max17048_test_reset_history(struct kunit *test) {
+  struct max17048_sample sample = {.vcell_uv = 3000000, .soc = 50 << 8};
+  struct max17048_test *ctx = test->priv;
+  struct max17048 *drv;
+  unsigned int i;
+
+  /* Leave the ring head partway through before the gauge resets */
+  drv = max17048_test_set(test, 48640, 60 << 8, 0);
+  for (i = 0; i < 5; i++)
+    max17048_hist_push(drv, &sample);
+  KUNIT_EXPECT_EQ(test, drv->hist_head, 5);
+
+  ctx->rec.status = MAX17048_STATUS_RI;
+  KUNIT_ASSERT_EQ(test, max17048_handle_reset(drv, &sample), 0);
+  KUNIT_EXPECT_EQ(test, drv->hist_len, 0);
+  max17048_hist_push(drv, &sample);
+
+  /* Only the post-reset sample may count, none of the 3 V ones */
+  KUNIT_EXPECT_EQ(test, drv->hist_len, 1);
+  KUNIT_EXPECT_EQ(test,
+                  max17048_test_get(test, POWER_SUPPLY_PROP_VOLTAGE_AVG, NULL),
+                  3800000);
+}
+
+/* Bus transactions of one query with nothing read recently */
+static const struct {
+  enum power_supply_property psp;
+  int16_t crate;
+  u64 xfers;
+} max17048_test_reads[] = {
+    {POWER_SUPPLY_PROP_STATUS, -100, 1},
+    {POWER_SUPPLY_PROP_STATUS, 0, 2}, /* SOC decides within the noise */
+    {POWER_SUPPLY_PROP_VOLTAGE_NOW, 0, 1},
+    {POWER_SUPPLY_PROP_CAPACITY, 0, 1},
+    {POWER_SUPPLY_PROP_CAPACITY_LEVEL, 0, 2},
+    {POWER_SUPPLY_PROP_CHARGE_NOW, 0, 1},
+    {POWER_SUPPLY_PROP_ENERGY_NOW, 0, 1},
+    {POWER_SUPPLY_PROP_CURRENT_NOW, -100, 1},
+    {POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW, -100, 1},
+    {POWER_SUPPLY_PROP_TIME_TO_FULL_NOW, 100, 2},
+    {POWER_SUPPLY_PROP_TIME_TO_FULL_NOW, -100, 1}, /* SOC is skipped */
+    {POWER_SUPPLY_PROP_CHARGE_FULL, 0, 0},
+    {POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN, 0, 0},
+    {POWER_SUPPLY_PROP_CYCLE_COUNT, 0, 0},
+    {POWER_SUPPLY_PROP_TECHNOLOGY, 0, 0},
+    {POWER_SUPPLY_PROP_PRESENT, 0, 0},
+};
+
+static void max17048_test_bus_reads(struct kunit *test) {
+  union power_supply_propval val;
+  struct max17048 *drv;
+  unsigned int i;
+  u64 xfers;
+
+  for (i = 0; i < ARRAY_SIZE(max17048_test_reads); i++) {
+    drv = max17048_test_set(test, 48640, 50 << 8,
+                            max17048_test_reads[i].crate);
+    xfers = drv->stats.xfers;
+    /* Queries without a value in this state, e.g. TTF, still count */
+    max17048_get_property(drv, max17048_test_reads[i].psp, &val);
+    KUNIT_EXPECT_EQ_MSG(test, drv->stats.xfers - xfers,
+                        max17048_test_reads[i].xfers, "property %d crate %d",
+                        max17048_test_reads[i].psp,
+                        max17048_test_reads[i].crate);
+  }
+}
+
+static void max17048_test_read_interval(struct kunit *test) {
+  u64 xfers;
+
+  /* Repeated queries within min_read_interval_ms stay off the bus */
+  max17048_test_set(test, 48640, 50 << 8, -100);
+  max17048_test_get(test, POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW, &xfers);
+  KUNIT_EXPECT_EQ(test, xfers, 1);
+  max17048_test_get(test, POWER_SUPPLY_PROP_VOLTAGE_NOW, &xfers);
+  KUNIT_EXPECT_EQ(test, xfers, 0);
+  max17048_test_get(test, POWER_SUPPLY_PROP_STATUS, &xfers);
+  KUNIT_EXPECT_EQ(test, xfers, 0);
+  max17048_test_get(test, POWER_SUPPLY_PROP_CAPACITY_LEVEL, &xfers);
+  KUNIT_EXPECT_EQ(test, xfers, 0);
+}
+
+static struct kunit_case max17048_test_cases[] = {
+    KUNIT_CASE(max17048_test_vcell),
+    KUNIT_CASE(max17048_test_soc_over_full),
+    KUNIT_CASE(max17048_test_crate_extremes),
+    KUNIT_CASE(max17048_test_zero_capacity),
+    KUNIT_CASE(max17048_test_status),
+    KUNIT_CASE(max17048_test_status_no_crate),
+    KUNIT_CASE(max17048_test_capacity_level),
+    KUNIT_CASE(max17048_test_reset_history),
+    KUNIT_CASE(max17048_test_bus_reads),
+    KUNIT_CASE(max17048_test_read_interval),
+    {}};
+
+static struct kunit_suite max17048_test_suite = {
+    .name = "max17048",
+    .init = max17048_test_init,
+    .exit = max17048_test_exit,
+    .test_cases = max17048_test_cases,
+};
+kunit_test_suite(max17048_test_suite);
@@ -6,29 +6,66 @@
  * Reworked to align with Acer Switch Battery Module standards.
  */
 
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
 #include <linux/i2c.h>
+#include <linux/idr.h>
+#include <linux/input.h>
 #include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/of.h>
+#include <linux/platform_device.h>
 #include <linux/power_supply.h>
 #include <linux/property.h>
+#include <linux/random.h>
 #include <linux/regmap.h>
+#include <linux/seq_file.h>
 
 #include <linux/interrupt.h>
+#include <linux/delay.h>
+#include <linux/fault-inject.h>
+#include <linux/firmware.h>
+#include <linux/gpio/consumer.h>
 #include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/nvmem-consumer.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
 #include <linux/workqueue.h>
 
+#define CREATE_TRACE_POINTS
+#include "max17048_trace.h"
+
 #define MAX17048_VCELL_REG 0x02
 #define MAX17048_SOC_REG 0x04
+#define MAX17048_MODE_REG 0x06
+#define MAX17048_VERSION_REG 0x08
 #define MAX17048_CONFIG_REG 0x0C
 #define MAX17048_VALRT_REG 0x14
 #define MAX17048_CRATE_REG 0x16
+#define MAX17048_VRESET_REG 0x18
 #define MAX17048_STATUS_REG 0x1A
 
+#define MAX17048_MODE_QUICK_START BIT(14)
+#define MAX17043_CONFIG_ALRT BIT(5)
+#define MAX17048_STATUS_RI BIT(8)
+#define MAX17048_STATUS_VH BIT(9)
+#define MAX17048_STATUS_VL BIT(10)
+#define MAX17048_STATUS_VR BIT(11)
+#define MAX17048_STATUS_HD BIT(12)
+#define MAX17048_STATUS_SC BIT(13)
+/* Alert flags the interrupt handler clears, RI is left to the poll work */
+#define MAX17048_STATUS_ALERTS                                                 \
+  (MAX17048_STATUS_VH | MAX17048_STATUS_VL | MAX17048_STATUS_VR |              \
+   MAX17048_STATUS_HD | MAX17048_STATUS_SC)
+
 /* Constants for conversions and thresholds */
 #define MAX17048_VCELL_LSB_NUM 625
 #define MAX17048_VCELL_LSB_DEN 8
+#define MAX17049_VCELL_LSB_DEN 4      /* Dual cell, twice the LSB */
 #define MAX17048_SOC_LSB_INV 256
 #define MAX17048_CRATE_LSB_NUM 52
 #define MAX17048_CRATE_LSB_DEN 25000
@@ -46,12 +83,106 @@
 #define MAX17048_MAX_ENERGY_UWH 18500000
 #define MAX17048_TTE_TUNING_FACTOR 8
 
+/* Restored capacity and cycle count */
+#define MAX17048_LEARN_MIN_PCT 50      /* Lower bound vs design capacity */
+#define MAX17048_LEARN_MAX_PCT 110     /* Upper bound vs design capacity */
+#define MAX17048_SOC_FULL_FINE (100 * MAX17048_SOC_LSB_INV)
+#define MAX17048_LEARN_MAGIC 0x4D58314C /* "MX1L" */
+
+/* Internal resistance and load-aware time to empty */
+#define MAX17048_HIST_LEN 16
+#define MAX17048_RINT_SOC_WIN 128      /* Pairs must lie within 0.5% SOC */
+#define MAX17048_RINT_MIN_DI 100000    /* uA, ignore small load steps */
+#define MAX17048_RINT_MIN_MOHM 10
+#define MAX17048_RINT_MAX_MOHM 2000
+#define MAX17048_DEFAULT_CUTOFF_UV 3300000 /* Per cell */
+#define MAX17048_MIN_CUTOFF_MV 2500
+#define MAX17048_MAX_CUTOFF_MV 4000
+
+/* Polling and uevent policy */
+#define MAX17048_POLL_IRQ_MS 300000    /* Heartbeat with ALRT wired */
+#define MAX17048_POLL_MS 30000         /* Without ALRT */
+#define MAX17048_MIN_POLL_MS 1000
+#define MAX17048_MAX_POLL_MS 3600000
+#define MAX17048_DEFAULT_SOC_HYST 1    /* % SOC change worth a uevent */
+#define MAX17048_MAX_SOC_HYST 50
+#define MAX17048_MAX_DISPLAY_RATE 100  /* % per minute */
+
+/* AC presence inferred from the gauge */
+#define MAX17048_AC_DEBOUNCE 3         /* Agreeing samples to change state */
+#define MAX17048_MAX_AC_DEBOUNCE 20
+#define MAX17048_AC_CONFIRM_MS 2000    /* Poll interval while a change is due */
+#define MAX17048_AC_SLOPE_UV 2000      /* VCELL step between samples */
+
+/* Charge termination */
+#define MAX17048_DEFAULT_VMAX_UV 4200000 /* Per cell */
+#define MAX17048_TERM_MARGIN_UV 50000  /* Per cell, plateau below the max */
+#define MAX17048_TERM_SLOPE_UV 2000    /* VCELL still rising */
+#define MAX17048_TERM_CRATE 24         /* ~5%/hr, C/20 taper */
+#define MAX17048_TERM_SAMPLES 3        /* Window of agreeing samples */
+#define MAX17048_MAX_TERM_SAMPLES 20
+
+/* Quick-start after power-on reset */
+#define MAX17048_QSTART_SETTLE_MS 175  /* First VCELL/SOC conversion */
+#define MAX17048_QSTART_MIN_UV 3000000 /* Only restart on a sane, */
+#define MAX17048_QSTART_MAX_UV 4250000 /* idle voltage per cell */
+
+/* Deferred first read */
+#define MAX17048_INIT_RETRY_MS 100
+#define MAX17048_INIT_RETRY_MAX_MS 30000
+
+/* Device health */
+#define MAX17048_REG_SLOTS (MAX17048_STATUS_REG / 2 + 1)
+#define MAX17048_OFFLINE_FAILS 3       /* Consecutive failures to go offline */
+#define MAX17048_BACKOFF_MIN_MS 1000
+#define MAX17048_BACKOFF_MAX_MS 300000
+
+/* Transfer retry policy on the shared bus */
+#define MAX17048_XFER_RETRIES 2
+#define MAX17048_XFER_BACKOFF_US 1000  /* Doubles per retry, plus jitter */
+
+/* Burst strategy */
+#define MAX17048_DEFAULT_BUS_HZ 100000
+#define MAX17048_WIDE_BURST_HZ 400000  /* Fast enough to read everything */
+/* Suspend drain accounting */
+#define MAX17048_DRAIN_BUCKETS 12      /* log2(m%/h), last one open ended */
+#define MAX17048_DRAIN_MIN_MS 300000   /* Shorter suspends are SOC noise */
+
+/* debugfs statistics */
+#define MAX17048_LAT_BUCKETS 16        /* log2(us), last one open ended */
+
+#define MAX17048_WIDE_BURST_REGS                                               \
+  ((MAX17048_STATUS_REG - MAX17048_VCELL_REG) / 2 + 1)
+
+static unsigned int min_read_interval_ms = 1000;
+module_param(min_read_interval_ms, uint, 0644);
+MODULE_PARM_DESC(min_read_interval_ms,
+                 "Answer reads of a register from its last value for this "
+                 "long (0 disables)");
+
+static unsigned int touch_quiet_ms = 150;
+module_param(touch_quiet_ms, uint, 0644);
+MODULE_PARM_DESC(touch_quiet_ms,
+                 "Defer gauge refresh until touch input is idle this long "
+                 "(0 disables)");
+
+static unsigned int touch_max_defer_ms = 5000;
+module_param(touch_max_defer_ms, uint, 0644);
+MODULE_PARM_DESC(touch_max_defer_ms,
+                 "Upper bound on how long touch input may defer a refresh");
+
+static bool quick_start;
+module_param(quick_start, bool, 0644);
+MODULE_PARM_DESC(quick_start,
+                 "Issue MODE.QuickStart when the gauge reports a reset");
+
 /**
  * The configuration of the regmap for MAX17048.
  * 8-bit registers, 16-bit values, Big Endian.
  */
 static const struct regmap_config max17048_regmap_cfg = {
     .reg_bits = 8,
+    .reg_stride = 2,
     .val_bits = 16,
     .val_format_endian = REGMAP_ENDIAN_BIG,
     .max_register = 0xFF,
@@ -59,237 +190,2101 @@ static const struct regmap_config max17048_regmap_cfg = {
     .cache_type = REGCACHE_NONE,
 };
 
+/**
+ * enum max17048_health - Reachability of the gauge
+ * @MAX17048_ONLINE:   Last transfer succeeded
+ * @MAX17048_DEGRADED: Recent transfers failed, still using the bus
+ * @MAX17048_OFFLINE:  Unreachable; only recovery probes touch the bus
+ */
+enum max17048_health {
+  MAX17048_ONLINE,
+  MAX17048_DEGRADED,
+  MAX17048_OFFLINE,
+};
+
+/**
+ * enum max17048_xfer - How bursts of registers are read
+ * @MAX17048_XFER_REGMAP:      regmap bulk reads, raw I2C or word by word
+ * @MAX17048_XFER_SMBUS_BLOCK: SMBus I2C block reads on SMBus-only adapters
+ */
+enum max17048_xfer {
+  MAX17048_XFER_REGMAP,
+  MAX17048_XFER_SMBUS_BLOCK,
+};
+
+/**
+ * struct max17048_tunables - Policy knobs adjustable at runtime
+ * @crate_noise_thr:   |CRATE| below this is treated as no current
+ * @full_soc_thr:      SOC in % at which an idle battery is full
+ * @tte_tuning_factor: Scale of the linear time-to-empty fallback
+ * @poll_ms:           Poll interval without ALRT
+ * @poll_irq_ms:       Heartbeat poll interval with ALRT
+ * @soc_hyst:          SOC change in % that warrants a uevent
+ * @display_rate:      Display SOC slew limit in % per minute, 0 for raw
+ * @ac_debounce:       Consecutive samples needed to change the AC state
+ * @term_crate:        C-Rate the charge current must taper below for FULL
+ * @term_samples:      Consecutive samples needed to enter or leave FULL
+ *
+ * Always read and written as a whole under the cache lock, so the refresh
+ * engine never sees a half-applied update.
+ */
+struct max17048_tunables {
+  int crate_noise_thr;
+  int full_soc_thr;
+  int tte_tuning_factor;
+  int poll_ms;
+  int poll_irq_ms;
+  int soc_hyst;
+  int display_rate;
+  int ac_debounce;
+  int term_crate;
+  int term_samples;
+};
+
+/**
+ * struct max17048_bus_stats - Transfer failure counters
+ * @nack:        Address or data not acknowledged
+ * @timeout:     Transfer timed out, typically a held SCL/SDA line
+ * @arbitration: Bus busy or arbitration lost
+ * @io:          Other bus errors reported by the adapter
+ * @other:       Anything not classified above
+ * @retries:     Transfers repeated after a transient error
+ * @recoveries:  Bus recoveries triggered
+ */
+struct max17048_bus_stats {
+  u32 nack;
+  u32 timeout;
+  u32 arbitration;
+  u32 io;
+  u32 other;
+  u32 retries;
+  u32 recoveries;
+};
+
+/**
+ * struct max17048_stats - Counters exposed in debugfs
+ * @xfers:       Bus transactions attempted, including retries
+ * @bytes:       Register bytes transferred by successful transactions
+ * @reg_reads:   Transactions per first register, indexed by register / 2
+ * @latency:     Transaction latency, bucket i counts [2^i, 2^(i+1)) us
+ * @uevents:     power_supply_changed() rounds issued by the poll work
+ * @suppressed:  Polls whose uevent was suppressed by hysteresis
+ * @wakeups:     Poll work runs
+ * @prop_hit:    Property reads served without bus traffic, per property
+ * @prop_miss:   Property reads that reached the bus, per property
+ *
+ * @prop_hit and @prop_miss are indexed like max17048_battery_props[].
+ */
+struct max17048_stats {
+  u64 xfers;
+  u64 bytes;
+  u64 reg_reads[MAX17048_REG_SLOTS];
+  u64 latency[MAX17048_LAT_BUCKETS];
+  u64 uevents;
+  u64 suppressed;
+  u64 wakeups;
+  u64 *prop_hit;
+  u64 *prop_miss;
+};
+
+#ifdef CONFIG_FAULT_INJECTION
+/**
+ * struct max17048_faults - Fault injection in the read path
+ * @read:       Fail the transfer without touching the bus
+ * @delay:      Stall the transfer by @delay_us first
+ * @soc:        Report a raw SOC of 0xFFFF, far above 100%
+ * @ri:         Flip STATUS.RI
+ * @fail_errno: Error returned by @read, as a positive number
+ * @delay_us:   Stall injected by @delay
+ */
+struct max17048_faults {
+  struct fault_attr read;
+  struct fault_attr delay;
+  struct fault_attr soc;
+  struct fault_attr ri;
+  u32 fail_errno;
+  u32 delay_us;
+};
+#endif
+
+/**
+ * struct max17048_drain - Battery drain while suspended
+ * @entry_stamp: Boot time of the suspend entry snapshot
+ * @entry_soc:   SOC at suspend entry in 1/256 %
+ * @entry_uv:    VCELL at suspend entry in uV
+ * @entry_valid: The entry snapshot was read successfully
+ * @last_uv:     VCELL drop over the last counted suspend in uV
+ * @last_rate:   Drain rate of the last counted suspend in 1/1000 % per hour
+ * @avg_rate:    Moving average of the drain rate, same unit
+ * @count:       Suspends counted
+ * @hist:        Drain rates, bucket i counts [2^i, 2^(i+1)) m%/h
+ */
+struct max17048_drain {
+  ktime_t entry_stamp;
+  int entry_soc;
+  int entry_uv;
+  bool entry_valid;
+  int last_uv;
+  u32 last_rate;
+  u32 avg_rate;
+  u32 count;
+  u32 hist[MAX17048_DRAIN_BUCKETS];
+};
+
+/**
+ * struct max17048_sample - One gauge reading
+ * @stamp:    Boot time of the reading
+ * @vcell_uv: Cell voltage in uV
+ * @soc:      State of charge in 1/256 %
+ * @crate:    Raw signed C-Rate
+ * @status:   Raw STATUS register
+ */
+struct max17048_sample {
+  ktime_t stamp;
+  int vcell_uv;
+  int soc;
+  int16_t crate;
+  u16 status;
+};
+
+/**
+ * struct max17048_learn - Learned battery parameters
+ * @charge_full_uah: Full-charge capacity in uAh, design unless restored
+ * @cycle_count:     Completed equivalent full discharge cycles
+ * @cycle_acc:       Discharged SOC towards the next cycle (1/256 %)
+ * @last_soc:        Fine SOC of the previous sample, negative if none
+ *
+ * The gauge has no current sense. CRATE is the slope of its own SOC
+ * estimate, so charge integrated from it always sums back to the capacity
+ * it was scaled by and capacity fade cannot be observed here.
+ * @charge_full_uah therefore only departs from design when a measured
+ * value is restored from nvmem or written through learned_params.
+ */
+struct max17048_learn {
+  u32 charge_full_uah;
+  u32 cycle_count;
+  u32 cycle_acc;
+  int last_soc;
+};
+
+/**
+ * struct max17048_learn_blob - Persistent form of the learned parameters
+ * @magic:           MAX17048_LEARN_MAGIC
+ * @charge_full_uah: See &struct max17048_learn
+ * @cycle_count:     See &struct max17048_learn
+ * @cycle_acc:       See &struct max17048_learn
+ */
+struct max17048_learn_blob {
+  __le32 magic;
+  __le32 charge_full_uah;
+  __le32 cycle_count;
+  __le32 cycle_acc;
+};
+
 /**
  * struct max17048 - Driver data for MAX17048 fuel gauge
- * @client:                 I2C client pointer
+ * @client:                 I2C client pointer, NULL when simulated
+ * @dev:                    Device the driver is bound to
+ * @irq:                    ALRT interrupt, 0 if not wired
  * @regmap:                 Regmap for device access
  * @battery:                Battery power supply device
  * @ac_adapter:             AC adapter power supply device
+ * @battery_desc:           Per-instance battery descriptor
+ * @ac_desc:                Per-instance AC adapter descriptor
+ * @id:                     Instance number, 0 keeps the legacy names
+ * @variant:                Chip variant, selected at probe
  * @monitor_thread:         Thread for polling AC status
  * @charge_full_design_uah: Design capacity in uAh
  * @energy_full_design_uwh: Design energy in uWh
- * @ac_online:              Cached AC online status
+ * @ac_online:              Debounced AC online state
+ * @ac_votes:               Consecutive samples contradicting @ac_online
+ * @ac_last_uv:             VCELL of the previous sample, 0 if none
+ * @ac_gpio:                Optional charger-detect input
+ * @ac_irq:                 Edge interrupt of @ac_gpio
+ * @ac_irq_requested:       The charger-detect handler is installed
+ * @vmax_uv:                Charge voltage of the pack
+ * @full_latched:           Charge termination was detected
+ * @full_votes:             Consecutive samples towards toggling @full_latched
+ * @full_last_uv:           VCELL of the previous sample, 0 if none
+ * @lock:                   Protects @learn and the sample history
+ * @learn:                  Learned capacity and cycle state
+ * @nvmem:                  Optional nvmem cell persisting @learn
+ * @hist:                   Ring of recent samples from the poll work
+ * @hist_head:              Next slot to write in @hist
+ * @hist_len:               Number of valid entries in @hist, from slot 0
+ * @rint_mohm:              Estimated internal resistance, 0 if unknown
+ * @cutoff_uv:              Loaded pack voltage considered empty
+ * @init_work:              Deferred first read and registration
+ * @init_retry_ms:          Current retry delay of @init_work
+ * @irq_requested:          The ALRT interrupt handler is installed
+ * @cache_lock:             Protects the register cache and health state
+ * @reg_val:                Last value read from each register
+ * @reg_valid:              Bitmap of @reg_val slots holding a value
+ * @reg_recent:             Bitmap of @reg_val slots no write has outdated
+ * @reg_stamp:              Jiffies each @reg_val slot was last read
+ * @absorbed_reads:         Reads answered from @reg_val within the interval
+ * @health:                 Reachability state machine
+ * @fails:                  Consecutive failed transfers
+ * @backoff_ms:             Current recovery probe interval while offline
+ * @stale:                  Values are served from @reg_val, not the bus
+ * @offline_reported:       The poll work has announced PRESENT=0
+ * @polling:                The poll work may be kicked, under @cache_lock
+ * @bus_stats:              Transfer failure counters, under @cache_lock
+ * @touch_handler:          Input handler watching touchscreen activity
+ * @last_touch:             Jiffies of the latest touch event
+ * @defer_since:            Jiffies the pending refresh was first deferred
+ * @deferring:              A refresh is being deferred for touch input
+ * @xfer:                   Burst transfer method for this adapter
+ * @bus_hz:                 Bus clock, from the adapter's firmware node
+ * @wide_burst:             Sample with one burst across VCELL..STATUS
+ * @tun:                    Runtime tunables, under @cache_lock
+ * @notified:               @notify_soc and @notify_status are valid
+ * @notify_soc:             SOC in % at the last uevent
+ * @notify_status:          Charging status at the last uevent
+ * @display_soc:            Smoothed SOC in 1/256 %, negative until sampled
+ * @display_stamp:          Sample time @display_soc was last advanced
+ * @stats:                  debugfs counters, under @cache_lock
+ * @debugfs:                Per-instance debugfs directory
+ * @sim:                    Simulated cell, NULL on real hardware
+ * @faults:                 Fault injection controls, see debugfs
+ * @drain:                  Suspend drain accounting, under @lock
  */
+struct max17048_sim;
+struct max17048_variant;
+
 struct max17048 {
   struct i2c_client *client;
+  struct device *dev;
+  int irq;
   struct regmap *regmap;
   struct power_supply *battery;
   u32 charge_full_design_uah;
   u32 energy_full_design_uwh;
   struct delayed_work work;
   struct power_supply *ac_adapter;
-  unsigned int delay;
+  struct power_supply_desc *battery_desc;
+  struct power_supply_desc *ac_desc;
+  bool ac_online;
+  unsigned int ac_votes;
+  int ac_last_uv;
+  struct gpio_desc *ac_gpio;
+  int ac_irq;
+  bool ac_irq_requested;
+  u32 vmax_uv;
+  bool full_latched;
+  unsigned int full_votes;
+  int full_last_uv;
+  int id;
+  const struct max17048_variant *variant;
+  struct mutex lock;
+  struct max17048_learn learn;
+  struct nvmem_cell *nvmem;
+  struct max17048_sample hist[MAX17048_HIST_LEN];
+  unsigned int hist_head;
+  unsigned int hist_len;
+  u32 rint_mohm;
+  u32 cutoff_uv;
+  struct delayed_work init_work;
+  unsigned int init_retry_ms;
+  bool irq_requested;
+  spinlock_t cache_lock;
+  u16 reg_val[MAX17048_REG_SLOTS];
+  unsigned long reg_valid;
+  unsigned long reg_recent;
+  unsigned long reg_stamp[MAX17048_REG_SLOTS];
+  u64 absorbed_reads;
+  enum max17048_health health;
+  unsigned int fails;
+  unsigned int backoff_ms;
+  bool stale;
+  bool offline_reported;
+  bool polling;
+  struct max17048_bus_stats bus_stats;
+  struct input_handler touch_handler;
+  unsigned long last_touch;
+  unsigned long defer_since;
+  bool deferring;
+  enum max17048_xfer xfer;
+  u32 bus_hz;
+  bool wide_burst;
+  struct max17048_tunables tun;
+  bool notified;
+  int notify_soc;
+  int notify_status;
+  int display_soc;
+  ktime_t display_stamp;
+  struct max17048_stats stats;
+  struct dentry *debugfs;
+  struct max17048_sim *sim;
+#ifdef CONFIG_FAULT_INJECTION
+  struct max17048_faults faults;
+#endif
+  struct max17048_drain drain;
 };
 
 /**
- * max17048_read_reg - Read a 16-bit register
- * @battery: Driver data
- * @reg:     Register address
+ * struct max17048_variant - Chip specific decoding
+ * @model:       Model name reported to userspace
+ * @cells:       Cells in series the chip measures
+ * @vcell_to_uv: VCELL conversion, single or dual cell
+ * @take_sample: Burst read of the measurement registers
+ * @has_crate:   The chip measures C-Rate
+ * @get_crate:   C-Rate read, -ENODATA on chips without CRATE
+ * @ack_alert:   Clear the alert flags and CONFIG.ALRT so ALRT deasserts,
+ *               returning STATUS if there is one
+ * @props:       Battery properties the chip can answer
+ * @num_props:   Number of entries in @props
  *
- * Returns value on success, negative error code on failure.
+ * Picked once at probe from the match data, so reads and conversions
+ * never branch on the chip type.
  */
-static int max17048_read_reg(struct max17048 *battery, u8 reg, u32 *val) {
-  return regmap_read(battery->regmap, reg, val);
+struct max17048_variant {
+  const char *model;
+  unsigned int cells;
+  int (*vcell_to_uv)(u32 vcell);
+  int (*take_sample)(struct max17048 *battery,
+                     struct max17048_sample *sample);
+  bool has_crate;
+  int (*get_crate)(struct max17048 *battery, int16_t *crate);
+  int (*ack_alert)(struct max17048 *battery, u16 *status);
+  const enum power_supply_property *props;
+  size_t num_props;
+};
+
+/**
+ * max17048_name - Instance name used in trace events
+ * @battery: Driver data
+ */
+static const char *max17048_name(struct max17048 *battery) {
+  return dev_name(battery->dev);
 }
 
 /**
- * max17048_get_vcell - Get battery voltage in microvolts
+ * max17048_get_tunables - Take a consistent copy of the tunables
+ * @battery: Driver data
+ * @tun:     Copy to fill
+ */
+static void max17048_get_tunables(struct max17048 *battery,
+                                  struct max17048_tunables *tun) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  *tun = battery->tun;
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+}
+
+static bool max17048_replay_step(struct max17048_sim *sim);
+static unsigned long max17048_replay_delay(struct max17048_sim *sim);
+
+/**
+ * max17048_poll_delay_locked - Current poll interval in jiffies
  * @battery: Driver data
  *
- * Returns voltage (uV) or error code.
+ * Called with the cache lock held.
  */
-static int max17048_get_vcell(struct max17048 *battery) {
-  u32 vcell = 0;
-  int ret;
+static unsigned long max17048_poll_delay_locked(struct max17048 *battery) {
+  unsigned long replay;
 
-  ret = max17048_read_reg(battery, MAX17048_VCELL_REG, &vcell);
-  if (ret)
-    return ret;
+  /* A replay is paced by its records */
+  replay = battery->sim ? max17048_replay_delay(battery->sim) : ULONG_MAX;
+  if (replay != ULONG_MAX)
+    return replay;
+  return msecs_to_jiffies(battery->irq_requested ? battery->tun.poll_irq_ms
+                                                 : battery->tun.poll_ms);
+}
 
-  /* 78.125uV per LSB -> vcell * 78.125 = vcell * 625 / 8 */
-  /* 78.125uV per LSB -> vcell * 78.125 = vcell * 625 / 8 */
-  return (vcell * MAX17048_VCELL_LSB_NUM / MAX17048_VCELL_LSB_DEN);
+/**
+ * max17048_poll_delay - Current poll interval in jiffies
+ * @battery: Driver data
+ */
+static unsigned long max17048_poll_delay(struct max17048 *battery) {
+  unsigned long flags, delay;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  delay = max17048_poll_delay_locked(battery);
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+  return delay;
 }
 
 /**
- * max17048_get_soc - Get State of Charge in percent (0-100)
+ * max17048_poll_sooner_locked - Bring the pending poll forward
  * @battery: Driver data
+ * @delay:   Latest acceptable delay in jiffies
  *
- * Returns SOC (%) or error code.
+ * Never postpones a run that is due earlier, and leaves a running work
+ * item to reschedule itself. Called with the cache lock held.
  */
-static int max17048_get_soc(struct max17048 *battery) {
-  u32 soc = 0;
-  int ret;
+static void max17048_poll_sooner_locked(struct max17048 *battery,
+                                        unsigned long delay) {
+  if (battery->polling && delayed_work_pending(&battery->work) &&
+      time_before(jiffies + delay, battery->work.timer.expires))
+    mod_delayed_work(system_wq, &battery->work, delay);
+}
 
-  ret = max17048_read_reg(battery, MAX17048_SOC_REG, &soc);
-  if (ret)
-    return ret;
+/**
+ * max17048_offline - Check whether the gauge is considered unreachable
+ * @battery: Driver data
+ */
+static bool max17048_offline(struct max17048 *battery) {
+  return READ_ONCE(battery->health) == MAX17048_OFFLINE;
+}
+
+/**
+ * max17048_bus_done - Account a transfer result in the health state
+ * @battery: Driver data
+ * @ret:     Transfer result
+ *
+ * Consecutive failures degrade and finally take the gauge offline, which
+ * stops property reads from touching the bus and hands recovery to the
+ * poll work's backoff probes. Any success brings the gauge back online.
+ */
+static void max17048_bus_done(struct max17048 *battery, int ret) {
+  struct device *dev = battery->dev;
+  enum max17048_health old, new;
+  unsigned long flags;
 
-  soc /= MAX17048_SOC_LSB_INV;
-  if (soc > 100)
-    soc = 100;
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  old = battery->health;
+  if (!ret) {
+    battery->fails = 0;
+    battery->stale = false;
+    new = MAX17048_ONLINE;
+  } else {
+    battery->fails++;
+    battery->stale = true;
+    new = battery->fails >= MAX17048_OFFLINE_FAILS ? MAX17048_OFFLINE
+                                                   : MAX17048_DEGRADED;
+    if (old == MAX17048_OFFLINE)
+      new = MAX17048_OFFLINE;
+  }
+  if (new == MAX17048_OFFLINE && old != MAX17048_OFFLINE) {
+    battery->backoff_ms = MAX17048_BACKOFF_MIN_MS;
+    /* Let the poll work report PRESENT=0 and start probing */
+    if (battery->polling)
+      mod_delayed_work(system_wq, &battery->work, 0);
+  }
+  battery->health = new;
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
 
-  return soc;
+  if (new == MAX17048_OFFLINE && old != MAX17048_OFFLINE)
+    dev_warn(dev, "Gauge unreachable (%d), backing off\n", ret);
+  else if (new == MAX17048_ONLINE && old == MAX17048_OFFLINE) {
+    dev_info(dev, "Gauge back online\n");
+  }
 }
 
 /**
- * max17048_get_crate - Get C-Rate raw value
+ * max17048_classify_error - Count a failed transfer by its cause
  * @battery: Driver data
- * @crate:   Pointer to store sign-extended 16-bit C-Rate
+ * @ret:     Transfer error
  *
- * Returns 0 on success, error code on failure.
+ * Returns true if the error is transient and worth retrying. A NACK is
+ * not: the gauge is absent or busy, and repeating only adds bus load.
  */
-static int max17048_get_crate(struct max17048 *battery, int16_t *crate) {
-  u32 crate_raw = 0;
+static bool max17048_classify_error(struct max17048 *battery, int ret) {
+  struct max17048_bus_stats *st = &battery->bus_stats;
+  unsigned long flags;
+  bool transient = true;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  switch (ret) {
+  case -ENXIO:
+  case -EREMOTEIO:
+    st->nack++;
+    transient = false;
+    break;
+  case -ETIMEDOUT:
+    st->timeout++;
+    break;
+  case -EAGAIN:
+  case -EBUSY:
+    st->arbitration++;
+    break;
+  case -EIO:
+    st->io++;
+    break;
+  default:
+    st->other++;
+    transient = false;
+    break;
+  }
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+  return transient;
+}
+
+/**
+ * max17048_recover_bus - Free a bus left stuck by a glitched transfer
+ * @battery: Driver data
+ *
+ * The touchscreen shares the bus, so a slave holding SDA low would stall
+ * touch input as well. Clocking it out is cheaper than waiting.
+ */
+static void max17048_recover_bus(struct max17048 *battery) {
+  struct i2c_adapter *adap;
+  unsigned long flags;
   int ret;
 
-  ret = max17048_read_reg(battery, MAX17048_CRATE_REG, &crate_raw);
-  if (ret)
-    return ret;
+  if (!battery->client)
+    return;
 
-  *crate = (int16_t)crate_raw;
-  return 0;
+  adap = battery->client->adapter;
+  i2c_lock_bus(adap, I2C_LOCK_ROOT_ADAPTER);
+  ret = i2c_recover_bus(adap);
+  i2c_unlock_bus(adap, I2C_LOCK_ROOT_ADAPTER);
+
+  if (ret == -EOPNOTSUPP || ret == -EBUSY)
+    return;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  battery->bus_stats.recoveries++;
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+  dev_warn_ratelimited(battery->dev, "Bus recovery: %d\n", ret);
 }
 
 /**
- * max17048_get_current - Get battery current in microamps
+ * max17048_smbus_block_read - Burst read through SMBus I2C block reads
  * @battery: Driver data
- * @val:     Pointer to store current (uA)
+ * @reg:     First register address
+ * @vals:    Register values
+ * @count:   Number of consecutive registers
  *
- * Positive = Charging, Negative = Discharging.
+ * regmap can only use word reads on adapters without I2C_FUNC_I2C, which
+ * costs one transfer per register.
  */
-static int max17048_get_current(struct max17048 *battery, int *val) {
-  int16_t crate;
-  int ret;
+static int max17048_smbus_block_read(struct max17048 *battery, u8 reg,
+                                     u16 *vals, int count) {
+  u8 buf[2 * MAX17048_REG_SLOTS];
+  int i, ret;
 
-  ret = max17048_get_crate(battery, &crate);
-  if (ret)
+  ret = i2c_smbus_read_i2c_block_data(battery->client, reg, count * 2, buf);
+  if (ret < 0)
     return ret;
+  if (ret != count * 2)
+    return -EIO;
 
-  /*
-   * C-Rate LSB is 0.208%/hr.
-   * Current = Capacity * C-Rate
-   * Current (uA) = charge_design_uah * crate * 0.208 / 100
-   *              = charge_design_uah * crate * 52 / 25000
-   */
-  *val = (int)div_s64((s64)battery->charge_full_design_uah * crate *
-                          MAX17048_CRATE_LSB_NUM,
-                      MAX17048_CRATE_LSB_DEN);
+  for (i = 0; i < count; i++)
+    vals[i] = (buf[2 * i] << 8) | buf[2 * i + 1];
   return 0;
 }
 
 /**
- * max17048_get_status - Get battery charging status
+ * max17048_setup_bus - Pick the burst strategy matching the adapter
  * @battery: Driver data
+ *
+ * Uses only adapter capabilities and firmware properties, no transfers.
+ * A bit-banged bus pays for every clock in CPU time, so it gets two short
+ * bursts of exactly the registers a sample needs. A hardware controller
+ * at 400 kHz or more reads VCELL through STATUS in a single burst, which
+ * saves a transaction and refreshes every cached register at once.
  */
-static int max17048_get_status(struct max17048 *battery) {
-  int16_t crate;
-  int ret, soc;
+static void max17048_setup_bus(struct max17048 *battery) {
+  struct i2c_adapter *adap;
+  struct device_node *np;
+  u32 func, delay_us;
 
-  ret = max17048_get_crate(battery, &crate);
-  if (ret)
-    return POWER_SUPPLY_STATUS_UNKNOWN;
+  /* The simulated gauge answers from memory */
+  if (!battery->client) {
+    battery->xfer = MAX17048_XFER_REGMAP;
+    battery->wide_burst = true;
+    return;
+  }
 
-  /* Threshold of 4 LSB (~0.8%/hr) for noise immunity */
-  /* Threshold of 4 LSB (~0.8%/hr) for noise immunity */
-  if (crate > MAX17048_CRATE_NOISE_THR)
-    return POWER_SUPPLY_STATUS_CHARGING;
-  if (crate < -MAX17048_CRATE_NOISE_THR)
-    return POWER_SUPPLY_STATUS_DISCHARGING;
+  adap = battery->client->adapter;
+  np = adap->dev.of_node;
+  func = i2c_get_functionality(adap);
+  battery->bus_hz = MAX17048_DEFAULT_BUS_HZ;
+  if (np && of_property_read_u32(np, "clock-frequency", &battery->bus_hz) &&
+      !of_property_read_u32(np, "i2c-gpio,delay-us", &delay_us) && delay_us)
+    /* i2c-algo-bit waits delay-us per clock half period */
+    battery->bus_hz = 500000 / delay_us;
 
-  soc = max17048_get_soc(battery);
+  if (!(func & I2C_FUNC_I2C) && (func & I2C_FUNC_SMBUS_READ_I2C_BLOCK))
+    battery->xfer = MAX17048_XFER_SMBUS_BLOCK;
+  else
+    battery->xfer = MAX17048_XFER_REGMAP;
 
-  /* High SOC and low current -> Full */
-  /* High SOC and low current -> Full */
-  if (soc >= MAX17048_FULL_SOC_THR)
-    return POWER_SUPPLY_STATUS_FULL;
+  /* Word-by-word reads gain nothing from a wider burst */
+  battery->wide_burst =
+      (func & (I2C_FUNC_I2C | I2C_FUNC_SMBUS_READ_I2C_BLOCK)) &&
+      battery->bus_hz >= MAX17048_WIDE_BURST_HZ;
 
-  return POWER_SUPPLY_STATUS_NOT_CHARGING;
+  dev_info(battery->dev, "Bus %u Hz, %s bursts%s\n",
+           battery->bus_hz, battery->wide_burst ? "wide" : "narrow",
+           battery->xfer == MAX17048_XFER_SMBUS_BLOCK ? " via SMBus" : "");
 }
 
+#ifdef CONFIG_FAULT_INJECTION
 /**
- * max17048_get_time_to_empty - Estimate time to empty
+ * max17048_inject_xfer - Apply the faults that replace or stall a transfer
  * @battery: Driver data
- * @val:     Pointer to store TTE (seconds)
+ *
+ * Returns 0 to go ahead with the transfer, or the injected error.
  */
-static int max17048_get_time_to_empty(struct max17048 *battery, int *val) {
-  int16_t crate;
-  int ret, soc;
-  int32_t discharge_rate;
+static int max17048_inject_xfer(struct max17048 *battery) {
+  struct max17048_faults *f = &battery->faults;
 
-  ret = max17048_get_crate(battery, &crate);
-  if (ret)
-    return ret;
+  if (should_fail(&f->delay, 1))
+    fsleep(READ_ONCE(f->delay_us));
+  if (should_fail(&f->read, 1))
+    return -(int)clamp_t(u32, READ_ONCE(f->fail_errno), 1, MAX_ERRNO);
+  return 0;
+}
 
-  if (crate >= -MAX17048_TTE_RATE_THR)
-    return -ENODATA;
+/**
+ * max17048_inject_values - Corrupt the values of a successful transfer
+ * @battery: Driver data
+ * @reg:     First register address
+ * @vals:    Register values
+ * @count:   Number of consecutive registers
+ */
+static void max17048_inject_values(struct max17048 *battery, u8 reg,
+                                   u16 *vals, int count) {
+  struct max17048_faults *f = &battery->faults;
+  int soc = (MAX17048_SOC_REG - reg) / 2;
+  int status = (MAX17048_STATUS_REG - reg) / 2;
 
-  soc = max17048_get_soc(battery);
-  if (soc < 0)
-    return soc;
+  if (reg <= MAX17048_SOC_REG && soc < count && should_fail(&f->soc, 1))
+    vals[soc] = 0xFFFF;
+  if (reg <= MAX17048_STATUS_REG && status < count && should_fail(&f->ri, 1))
+    vals[status] ^= MAX17048_STATUS_RI;
+}
 
-  discharge_rate = abs(crate);
-  /* TTE (s) = 225000 * soc / (discharge_rate * 13) */
-  /* Adjusted by tuning factor to match observed discharge profile */
-  *val = (int)div_s64((s64)MAX17048_TTE_CONST_NUM * soc *
-                          MAX17048_TTE_TUNING_FACTOR,
-                      (s64)discharge_rate * MAX17048_TTE_CONST_DEN);
-  return 0;
+/**
+ * max17048_faults_init - Create the fault injection controls
+ * @drv: Driver data
+ *
+ * Each fault is a standard fault_attr directory under the instance's
+ * debugfs directory, e.g. fail_read/interval=10 with probability=100
+ * fails every tenth transfer.
+ */
+static void max17048_faults_init(struct max17048 *drv) {
+  struct max17048_faults *f = &drv->faults;
+
+  f->read = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+  f->delay = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+  f->soc = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+  f->ri = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+  f->fail_errno = EIO;
+  f->delay_us = 10000;
+
+  fault_create_debugfs_attr("fail_read", drv->debugfs, &f->read);
+  fault_create_debugfs_attr("fail_delay", drv->debugfs, &f->delay);
+  fault_create_debugfs_attr("fail_soc", drv->debugfs, &f->soc);
+  fault_create_debugfs_attr("fail_ri", drv->debugfs, &f->ri);
+  debugfs_create_u32("fail_errno", 0644, drv->debugfs, &f->fail_errno);
+  debugfs_create_u32("fail_delay_us", 0644, drv->debugfs, &f->delay_us);
 }
+#else
+static int max17048_inject_xfer(struct max17048 *battery) { return 0; }
+
+static void max17048_inject_values(struct max17048 *battery, u8 reg,
+                                   u16 *vals, int count) {}
+
+static void max17048_faults_init(struct max17048 *drv) {}
+#endif
 
 /**
- * max17048_get_time_to_full - Estimate time to full
+ * max17048_account_xfer - Count one bus transaction for debugfs
  * @battery: Driver data
- * @val:     Pointer to store TTF (seconds)
+ * @reg:     First register address
+ * @count:   Number of consecutive registers
+ * @ret:     Result of the transaction
+ * @latency: Duration of the transaction in ns
  */
-static int max17048_get_time_to_full(struct max17048 *battery, int *val) {
-  int16_t crate;
-  int ret, soc;
+static void max17048_account_xfer(struct max17048 *battery, u8 reg, int count,
+                                  int ret, u64 latency) {
+  struct max17048_stats *st = &battery->stats;
+  u32 us = (u32)min_t(u64, div_u64(latency, NSEC_PER_USEC), U32_MAX);
+  unsigned long flags;
 
-  ret = max17048_get_crate(battery, &crate);
-  if (ret)
-    return ret;
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  st->xfers++;
+  if (!ret)
+    st->bytes += count * 2;
+  st->reg_reads[reg / 2]++;
+  st->latency[min(us ? ilog2(us) : 0, MAX17048_LAT_BUCKETS - 1)]++;
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+}
 
-  if (crate <= MAX17048_TTE_RATE_THR)
-    return -ENODATA;
+/**
+ * max17048_xfer_read - Bulk read with bounded, jittered retries
+ * @battery: Driver data
+ * @reg:     First register address
+ * @vals:    Register values
+ * @count:   Number of consecutive registers
+ *
+ * Transient errors are retried a bounded number of times after a short
+ * randomized pause, which lets the touchscreen get its transfers in
+ * between. Timeouts and busy errors first attempt a bus recovery.
+ */
+static int max17048_xfer_read(struct max17048 *battery, u8 reg, u16 *vals,
+                              int count) {
+  unsigned long flags;
+  unsigned int delay;
+  int ret, attempt;
 
-  soc = max17048_get_soc(battery);
-  if (soc < 0)
-    return soc;
+  for (attempt = 0;; attempt++) {
+    u64 start = ktime_get_ns(), latency;
 
-  *val = (int)div_s64((s64)MAX17048_TTE_CONST_NUM * (100 - soc),
-                      (s64)crate * MAX17048_TTE_CONST_DEN);
-  return 0;
+    ret = max17048_inject_xfer(battery);
+    if (!ret && battery->xfer == MAX17048_XFER_SMBUS_BLOCK)
+      ret = max17048_smbus_block_read(battery, reg, vals, count);
+    else if (!ret)
+      ret = regmap_bulk_read(battery->regmap, reg, vals, count);
+    if (!ret)
+      max17048_inject_values(battery, reg, vals, count);
+    latency = ktime_get_ns() - start;
+    trace_max17048_reg_read(max17048_name(battery), reg, count, ret, latency);
+    max17048_account_xfer(battery, reg, count, ret, latency);
+    if (!ret || !max17048_classify_error(battery, ret) ||
+        attempt >= MAX17048_XFER_RETRIES)
+      return ret;
+
+    if (ret == -ETIMEDOUT || ret == -EBUSY || ret == -EAGAIN)
+      max17048_recover_bus(battery);
+
+    spin_lock_irqsave(&battery->cache_lock, flags);
+    battery->bus_stats.retries++;
+    spin_unlock_irqrestore(&battery->cache_lock, flags);
+
+    delay = MAX17048_XFER_BACKOFF_US << attempt;
+    delay += get_random_u32_below(delay);
+    usleep_range(delay, delay + MAX17048_XFER_BACKOFF_US);
+  }
 }
 
 /**
- * max17048_get_capacity_level - Get capacity level description
+ * max17048_cache_store - Remember register values as last known good
  * @battery: Driver data
+ * @reg:     First register address
+ * @vals:    Register values
+ * @count:   Number of consecutive registers
  */
-static int max17048_get_capacity_level(struct max17048 *battery) {
-  int soc = max17048_get_soc(battery);
-  int status = max17048_get_status(battery);
+static void max17048_cache_store(struct max17048 *battery, u8 reg,
+                                 const u16 *vals, int count) {
+  unsigned long flags;
+  int i, slot;
 
-  if (soc < 0)
-    return POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN;
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  for (i = 0; i < count; i++) {
+    slot = reg / 2 + i;
+    battery->reg_val[slot] = vals[i];
+    battery->reg_stamp[slot] = jiffies;
+    battery->reg_valid |= BIT(slot);
+    battery->reg_recent |= BIT(slot);
+  }
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+}
 
-  if (status == POWER_SUPPLY_STATUS_FULL || soc >= MAX17048_CAP_FULL_THR)
-    return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-  else if (soc <= MAX17048_CAP_CRIT_THR)
-    return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
-  else if (soc <= MAX17048_CAP_LOW_THR)
-    return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+/**
+ * max17048_cache_expire - Stop answering reads from the cache
+ * @battery: Driver data
+ *
+ * A write can change any measurement register, QuickStart restarts them
+ * all, so the next read of every register goes to the gauge. The values
+ * stay available as last known good.
+ */
+static void max17048_cache_expire(struct max17048 *battery) {
+  unsigned long flags;
 
-  return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  battery->reg_recent = 0;
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
 }
 
 /**
- * battery_get_property - Power Supply API get_property callback
+ * max17048_cache_recent - Answer a read from values read moments ago
+ * @battery: Driver data
+ * @reg:     First register address
+ * @vals:    Register values
+ * @count:   Number of consecutive registers
+ *
+ * Bounds bus utilization no matter how often userspace polls: every
+ * register is read from the gauge at most once per min_read_interval_ms.
+ *
+ * Returns true if all registers were answered from the cache.
  */
-static int battery_get_property(struct power_supply *psy,
-                                enum power_supply_property psp,
-                                union power_supply_propval *val) {
-  struct max17048 *battery = power_supply_get_drvdata(psy);
+static bool max17048_cache_recent(struct max17048 *battery, u8 reg, u16 *vals,
+                                  int count) {
+  unsigned long interval = msecs_to_jiffies(READ_ONCE(min_read_interval_ms));
+  unsigned long flags, now = jiffies;
+  bool hit = !!interval;
+  int i, slot;
+
+  if (!hit)
+    return false;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  for (i = 0; i < count && hit; i++) {
+    slot = reg / 2 + i;
+    hit = (battery->reg_recent & BIT(slot)) &&
+          time_before(now, battery->reg_stamp[slot] + interval);
+    vals[i] = battery->reg_val[slot];
+  }
+  if (hit)
+    battery->absorbed_reads++;
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+  return hit;
+}
+
+/**
+ * max17048_cache_load - Fetch last known good register values
+ * @battery: Driver data
+ * @reg:     First register address
+ * @vals:    Register values
+ * @count:   Number of consecutive registers
+ *
+ * Returns 0 on success, -EIO if any register was never read.
+ */
+static int max17048_cache_load(struct max17048 *battery, u8 reg, u16 *vals,
+                               int count) {
+  unsigned long flags;
+  int i, slot, ret = 0;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  for (i = 0; i < count; i++) {
+    slot = reg / 2 + i;
+    if (!(battery->reg_valid & BIT(slot))) {
+      ret = -EIO;
+      break;
+    }
+    vals[i] = battery->reg_val[slot];
+  }
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+  return ret;
+}
+
+/**
+ * max17048_read_block - Read consecutive 16-bit registers
+ * @battery: Driver data
+ * @reg:     First register address
+ * @vals:    Register values
+ * @count:   Number of consecutive registers
+ *
+ * Falls back to the last known good values when the transfer fails, and
+ * does not touch the bus at all while the gauge is offline.
+ *
+ * Returns 0 for fresh values, 1 for stale ones, negative error code if
+ * neither is available.
+ */
+static int max17048_read_block(struct max17048 *battery, u8 reg, u16 *vals,
+                               int count) {
+  int ret;
+
+  if (max17048_cache_recent(battery, reg, vals, count))
+    return 0;
+
+  if (!max17048_offline(battery)) {
+    ret = max17048_xfer_read(battery, reg, vals, count);
+    max17048_bus_done(battery, ret);
+    if (!ret) {
+      max17048_cache_store(battery, reg, vals, count);
+      return 0;
+    }
+  }
+
+  return max17048_cache_load(battery, reg, vals, count) ?: 1;
+}
+
+/**
+ * max17048_read_reg - Read a 16-bit register
+ * @battery: Driver data
+ * @reg:     Register address
+ *
+ * Returns 0 on success (possibly with a stale value, see
+ * max17048_read_block()), negative error code on failure.
+ */
+static int max17048_read_reg(struct max17048 *battery, u8 reg, u32 *val) {
+  u16 v;
+  int ret;
+
+  if (reg > MAX17048_STATUS_REG)
+    return regmap_read(battery->regmap, reg, val);
+
+  ret = max17048_read_block(battery, reg, &v, 1);
+  if (ret < 0)
+    return ret;
+
+  *val = v;
+  return 0;
+}
+
+/**
+ * max17048_write_reg - Write a 16-bit register
+ * @battery: Driver data
+ * @reg:     Register address
+ * @val:     Value
+ *
+ * Returns 0 on success, error code on failure.
+ */
+static int max17048_write_reg(struct max17048 *battery, u8 reg, u32 val) {
+  int ret;
+
+  ret = regmap_write(battery->regmap, reg, val);
+  max17048_cache_expire(battery);
+  return ret;
+}
+
+/**
+ * max17048_update_reg - Read-modify-write a 16-bit register
+ * @battery: Driver data
+ * @reg:     Register address
+ * @mask:    Bits to change
+ * @val:     New value of the bits in @mask
+ *
+ * Returns 0 on success, error code on failure.
+ */
+static int max17048_update_reg(struct max17048 *battery, u8 reg, u32 mask,
+                               u32 val) {
+  int ret;
+
+  ret = regmap_update_bits(battery->regmap, reg, mask, val);
+  max17048_cache_expire(battery);
+  return ret;
+}
+
+/**
+ * max17048_probe_bus - Cheap reachability check
+ * @battery: Driver data
+ *
+ * A single register read that bypasses the offline short-circuit, used to
+ * detect recovery. Returns 0 if the gauge answered.
+ */
+static int max17048_probe_bus(struct max17048 *battery) {
+  u32 version;
+  int ret;
+
+  ret = regmap_read(battery->regmap, MAX17048_VERSION_REG, &version);
+  if (ret)
+    max17048_classify_error(battery, ret);
+  max17048_bus_done(battery, ret);
+  return ret;
+}
+
+/**
+ * max17048_vcell_to_uv - Convert a raw VCELL value to microvolts
+ * @vcell: Raw VCELL register
+ */
+static int max17048_vcell_to_uv(u32 vcell) {
+  /* 78.125uV per LSB -> vcell * 78.125 = vcell * 625 / 8 */
+  return (vcell * MAX17048_VCELL_LSB_NUM / MAX17048_VCELL_LSB_DEN);
+}
+
+/**
+ * max17049_vcell_to_uv - Convert a raw dual-cell VCELL value to microvolts
+ * @vcell: Raw VCELL register
+ *
+ * Also covers the MAX17044, whose 12-bit 2.5 mV LSB is the same scale.
+ */
+static int max17049_vcell_to_uv(u32 vcell) {
+  /* 156.25uV per LSB -> vcell * 625 / 4 */
+  return (vcell * MAX17048_VCELL_LSB_NUM / MAX17049_VCELL_LSB_DEN);
+}
+
+/**
+ * max17048_get_vcell - Get battery voltage in microvolts
+ * @battery: Driver data
+ *
+ * Returns voltage (uV) or error code.
+ */
+static int max17048_get_vcell(struct max17048 *battery) {
+  u32 vcell = 0;
+  int ret;
+
+  ret = max17048_read_reg(battery, MAX17048_VCELL_REG, &vcell);
+  if (ret)
+    return ret;
+
+  return battery->variant->vcell_to_uv(vcell);
+}
+
+/**
+ * max17048_soc_to_pct - Convert a raw SOC to whole percent
+ * @soc: Raw SOC in 1/256 %
+ *
+ * The gauge can report more than 100% after a charge; that is clamped.
+ */
+static int max17048_soc_to_pct(u32 soc) {
+  return min_t(u32, soc / MAX17048_SOC_LSB_INV, 100);
+}
+
+/**
+ * max17048_get_soc - Get State of Charge in percent (0-100)
+ * @battery: Driver data
+ *
+ * Returns SOC (%) or error code.
+ */
+static int max17048_get_soc(struct max17048 *battery) {
+  u32 soc = 0;
+  int ret;
+
+  ret = max17048_read_reg(battery, MAX17048_SOC_REG, &soc);
+  if (ret)
+    return ret;
+
+  return max17048_soc_to_pct(soc);
+}
+
+/**
+ * max17048_get_soc_fine - Get State of Charge in 1/256 percent
+ * @battery: Driver data
+ *
+ * Returns raw SOC or error code.
+ */
+static int max17048_get_soc_fine(struct max17048 *battery) {
+  u32 soc = 0;
+  int ret;
+
+  ret = max17048_read_reg(battery, MAX17048_SOC_REG, &soc);
+  if (ret)
+    return ret;
+
+  return min_t(u32, soc, MAX17048_SOC_FULL_FINE);
+}
+
+/**
+ * max17048_charge_full - Get the full-charge capacity in uAh
+ * @battery: Driver data
+ */
+static u32 max17048_charge_full(struct max17048 *battery) {
+  return READ_ONCE(battery->learn.charge_full_uah);
+}
+
+/**
+ * max17048_energy_full - Get the full-charge energy in uWh
+ * @battery: Driver data
+ *
+ * Scales the design energy by the ratio of restored to design capacity.
+ */
+static u32 max17048_energy_full(struct max17048 *battery) {
+  return (u32)div_u64((u64)battery->energy_full_design_uwh *
+                          max17048_charge_full(battery),
+                      battery->charge_full_design_uah);
+}
+
+/**
+ * max17048_read_crate - Read the C-Rate register
+ * @battery: Driver data
+ * @crate:   Pointer to store sign-extended 16-bit C-Rate
+ *
+ * Returns 0 on success, error code on failure.
+ */
+static int max17048_read_crate(struct max17048 *battery, int16_t *crate) {
+  u32 crate_raw = 0;
+  int ret;
+
+  ret = max17048_read_reg(battery, MAX17048_CRATE_REG, &crate_raw);
+  if (ret)
+    return ret;
+
+  *crate = (int16_t)crate_raw;
+  return 0;
+}
+
+/**
+ * max17043_no_crate - C-Rate of chips without a CRATE register
+ * @battery: Driver data
+ * @crate:   Unused
+ */
+static int max17043_no_crate(struct max17048 *battery, int16_t *crate) {
+  return -ENODATA;
+}
+
+/**
+ * max17048_get_crate - Get C-Rate raw value
+ * @battery: Driver data
+ * @crate:   Pointer to store sign-extended 16-bit C-Rate
+ *
+ * Returns 0 on success, error code on failure.
+ */
+static int max17048_get_crate(struct max17048 *battery, int16_t *crate) {
+  return battery->variant->get_crate(battery, crate);
+}
+
+/**
+ * max17048_crate_scale - Convert a C-Rate to microamps for a capacity
+ * @charge_uah: Full-charge capacity in uAh
+ * @crate:      Signed C-Rate in LSB, may exceed 16 bits for averages
+ *
+ * Does not overflow for any 16-bit C-Rate up to MAX17048_MAX_CAP_UAH.
+ */
+static int max17048_crate_scale(u32 charge_uah, int crate) {
+  /*
+   * C-Rate LSB is 0.208%/hr.
+   * Current = Capacity * C-Rate
+   * Current (uA) = charge_full_uah * crate * 0.208 / 100
+   *              = charge_full_uah * crate * 52 / 25000
+   */
+  return (int)div_s64((s64)charge_uah * crate * MAX17048_CRATE_LSB_NUM,
+                      MAX17048_CRATE_LSB_DEN);
+}
+
+/**
+ * max17048_crate_to_ua - Convert a raw C-Rate to microamps
+ * @battery: Driver data
+ * @crate:   Raw signed C-Rate
+ */
+static int max17048_crate_to_ua(struct max17048 *battery, int crate) {
+  return max17048_crate_scale(max17048_charge_full(battery), crate);
+}
+
+/**
+ * max17048_get_current - Get battery current in microamps
+ * @battery: Driver data
+ * @val:     Pointer to store current (uA)
+ *
+ * Positive = Charging, Negative = Discharging.
+ */
+static int max17048_get_current(struct max17048 *battery, int *val) {
+  int16_t crate;
+  int ret;
+
+  ret = max17048_get_crate(battery, &crate);
+  if (ret)
+    return ret;
+
+  *val = max17048_crate_to_ua(battery, crate);
+  return 0;
+}
+
+static ktime_t max17048_sim_clock(struct max17048_sim *sim);
+
+/**
+ * max17048_now - Timestamp for a sample
+ * @battery: Driver data
+ *
+ * A simulated gauge stamps samples with model time, so history and time
+ * estimates see the accelerated clock the readings were produced on.
+ */
+static ktime_t max17048_now(struct max17048 *battery) {
+  return battery->sim ? max17048_sim_clock(battery->sim)
+                      : ktime_get_boottime();
+}
+
+/**
+ * max17048_burst_sample - Burst-read voltage, SOC, C-Rate and status
+ * @battery: Driver data
+ * @sample:  Sample to fill
+ *
+ * VCELL/SOC and CRATE/VRESET/STATUS are adjacent, so two bulk transfers
+ * replace four single-register reads. On a fast bus a single burst across
+ * the whole block is used instead, see max17048_setup_bus().
+ *
+ * Returns 0 on success, 1 if the sample is made of last known good
+ * values, negative error code on failure.
+ */
+static int max17048_burst_sample(struct max17048 *battery,
+                                 struct max17048_sample *sample) {
+  const struct max17048_variant *variant = battery->variant;
+  u16 regs[MAX17048_WIDE_BURST_REGS];
+  int ret, stale;
+
+  if (battery->wide_burst) {
+    ret = max17048_read_block(battery, MAX17048_VCELL_REG, regs,
+                              MAX17048_WIDE_BURST_REGS);
+    if (ret < 0)
+      return ret;
+    sample->vcell_uv = variant->vcell_to_uv(regs[0]);
+    sample->soc = min_t(u32, regs[1], MAX17048_SOC_FULL_FINE);
+    sample->crate =
+        (int16_t)regs[(MAX17048_CRATE_REG - MAX17048_VCELL_REG) / 2];
+    sample->status = regs[(MAX17048_STATUS_REG - MAX17048_VCELL_REG) / 2];
+    sample->stamp = max17048_now(battery);
+    return ret;
+  }
+
+  stale = max17048_read_block(battery, MAX17048_VCELL_REG, regs, 2);
+  if (stale < 0)
+    return stale;
+  sample->vcell_uv = variant->vcell_to_uv(regs[0]);
+  sample->soc = min_t(u32, regs[1], MAX17048_SOC_FULL_FINE);
+
+  ret = max17048_read_block(battery, MAX17048_CRATE_REG, regs, 3);
+  if (ret < 0)
+    return ret;
+  sample->crate = (int16_t)regs[0];
+  sample->status = regs[2];
+
+  sample->stamp = max17048_now(battery);
+  return stale | ret;
+}
+
+/**
+ * max17043_basic_sample - Read voltage and SOC of chips without CRATE
+ * @battery: Driver data
+ * @sample:  Sample to fill, with zero C-Rate and status
+ *
+ * Returns 0 on success, 1 if the sample is made of last known good
+ * values, negative error code on failure.
+ */
+static int max17043_basic_sample(struct max17048 *battery,
+                                 struct max17048_sample *sample) {
+  u16 regs[2];
+  int ret;
+
+  ret = max17048_read_block(battery, MAX17048_VCELL_REG, regs, 2);
+  if (ret < 0)
+    return ret;
+  sample->vcell_uv = battery->variant->vcell_to_uv(regs[0]);
+  sample->soc = min_t(u32, regs[1], MAX17048_SOC_FULL_FINE);
+  sample->crate = 0;
+  sample->status = 0;
+  sample->stamp = max17048_now(battery);
+  return ret;
+}
+
+/**
+ * max17048_take_sample - Read the measurement registers
+ * @battery: Driver data
+ * @sample:  Sample to fill
+ *
+ * Returns 0 on success, 1 if the sample is made of last known good
+ * values, negative error code on failure.
+ */
+static int max17048_take_sample(struct max17048 *battery,
+                                struct max17048_sample *sample) {
+  return battery->variant->take_sample(battery, sample);
+}
+
+/**
+ * max17048_hist_push - Record a sample and refine the resistance estimate
+ * @drv:    Driver data
+ * @sample: New sample
+ *
+ * Pairs the new sample with every recorded one at nearly the same SOC, so
+ * the open-circuit voltage is the same for both and a voltage difference
+ * can only come from the load difference. The least-squares slope of
+ * dV over dI across those pairs is the internal resistance.
+ */
+static void max17048_hist_push(struct max17048 *drv,
+                               const struct max17048_sample *sample) {
+  s64 sxy = 0, sxx = 0;
+  int cur = max17048_crate_to_ua(drv, sample->crate);
+  unsigned int i;
+  u32 rint;
+
+  mutex_lock(&drv->lock);
+  for (i = 0; i < drv->hist_len; i++) {
+    const struct max17048_sample *h = &drv->hist[i];
+    s64 dv, di;
+
+    if (abs(h->soc - sample->soc) > MAX17048_RINT_SOC_WIN)
+      continue;
+
+    di = cur - max17048_crate_to_ua(drv, h->crate);
+    if (abs(di) < MAX17048_RINT_MIN_DI)
+      continue;
+
+    /* Voltage rises with charge current: V = OCV + I * R */
+    dv = sample->vcell_uv - h->vcell_uv;
+    sxy += dv * di;
+    sxx += di * di;
+  }
+
+  if (sxx && sxy > 0) {
+    rint = (u32)div64_s64(sxy * 1000, sxx);
+    if (rint >= MAX17048_RINT_MIN_MOHM && rint <= MAX17048_RINT_MAX_MOHM)
+      drv->rint_mohm = drv->rint_mohm ? (drv->rint_mohm * 3 + rint) / 4 : rint;
+  }
+
+  drv->hist[drv->hist_head] = *sample;
+  drv->hist_head = (drv->hist_head + 1) % MAX17048_HIST_LEN;
+  if (drv->hist_len < MAX17048_HIST_LEN)
+    drv->hist_len++;
+  mutex_unlock(&drv->lock);
+}
+
+/**
+ * max17048_hist_summary - Average the recorded samples
+ * @drv:      Driver data
+ * @latest:   Most recent sample, may be NULL
+ * @vcell_uv: Mean cell voltage in uV, may be NULL
+ * @power_uw: Mean power in uW, positive while charging, may be NULL
+ *
+ * Works on the history the poll work already keeps, so none of the
+ * derived properties costs a bus transfer. Power is averaged per sample
+ * rather than taken from the mean voltage and current, which would miss
+ * the correlation of voltage sag with load.
+ *
+ * Returns 0 on success, -ENODATA before the first poll.
+ */
+static int max17048_hist_summary(struct max17048 *drv,
+                                 struct max17048_sample *latest, int *vcell_uv,
+                                 int *power_uw) {
+  s64 vsum = 0, psum = 0;
+  unsigned int i, n;
+
+  mutex_lock(&drv->lock);
+  n = drv->hist_len;
+  for (i = 0; i < n; i++) {
+    const struct max17048_sample *h = &drv->hist[i];
+
+    vsum += h->vcell_uv;
+    psum += div_s64((s64)h->vcell_uv * max17048_crate_to_ua(drv, h->crate),
+                    1000000);
+  }
+  if (n && latest)
+    *latest = drv->hist[(drv->hist_head + MAX17048_HIST_LEN - 1) %
+                        MAX17048_HIST_LEN];
+  mutex_unlock(&drv->lock);
+
+  if (!n)
+    return -ENODATA;
+  if (vcell_uv)
+    *vcell_uv = (int)div_s64(vsum, n);
+  if (power_uw)
+    *power_uw = (int)div_s64(psum, n);
+  return 0;
+}
+
+/**
+ * max17048_get_power_now - Power of the most recent sample
+ * @battery: Driver data
+ * @val:     Pointer to store power (uW), positive while charging
+ */
+static int max17048_get_power_now(struct max17048 *battery, int *val) {
+  struct max17048_sample now;
+  int ret;
+
+  ret = max17048_hist_summary(battery, &now, NULL, NULL);
+  if (ret)
+    return ret;
+
+  *val = (int)div_s64((s64)now.vcell_uv *
+                          max17048_crate_to_ua(battery, now.crate),
+                      1000000);
+  return 0;
+}
+
+/**
+ * max17048_get_ocv - Estimate the open-circuit voltage
+ * @battery: Driver data
+ * @val:     Pointer to store OCV (uV)
+ *
+ * Removes the drop across the estimated internal resistance from the most
+ * recent sample: V = OCV + I * R. Returns -ENODATA until both a sample and
+ * a resistance estimate exist.
+ */
+static int max17048_get_ocv(struct max17048 *battery, int *val) {
+  struct max17048_sample now;
+  u32 rint = READ_ONCE(battery->rint_mohm);
+  int ret;
+
+  if (!rint)
+    return -ENODATA;
+
+  ret = max17048_hist_summary(battery, &now, NULL, NULL);
+  if (ret)
+    return ret;
+
+  *val = now.vcell_uv -
+         (int)div_s64((s64)max17048_crate_to_ua(battery, now.crate) * rint,
+                      1000);
+  return 0;
+}
+
+/**
+ * max17048_decode_status - Derive the charging status from a reading
+ * @tun:   Tunables in effect
+ * @crate: Raw signed C-Rate
+ * @soc:   State of charge in percent
+ */
+static int max17048_decode_status(const struct max17048_tunables *tun,
+                                  int16_t crate, int soc) {
+  /* Threshold of 4 LSB (~0.8%/hr) by default for noise immunity */
+  if (crate > tun->crate_noise_thr)
+    return POWER_SUPPLY_STATUS_CHARGING;
+  if (crate < -tun->crate_noise_thr)
+    return POWER_SUPPLY_STATUS_DISCHARGING;
+
+  /* High SOC and low current -> Full */
+  if (soc >= tun->full_soc_thr)
+    return POWER_SUPPLY_STATUS_FULL;
+
+  return POWER_SUPPLY_STATUS_NOT_CHARGING;
+}
+
+/**
+ * max17048_full_status - Apply charge termination to a decoded status
+ * @drv:    Driver data
+ * @status: Status from max17048_decode_status()
+ *
+ * FULL is only reported once the poll work has latched termination, see
+ * max17048_full_update(), and not once a charger-detect GPIO reports the
+ * adapter gone. An idle battery near the top is still charging
+ * while the adapter is present and idle otherwise.
+ */
+static int max17048_full_status(struct max17048 *drv, int status) {
+  if (READ_ONCE(drv->full_latched) && READ_ONCE(drv->ac_online))
+    return POWER_SUPPLY_STATUS_FULL;
+  if (status == POWER_SUPPLY_STATUS_FULL)
+    return READ_ONCE(drv->ac_online) ? POWER_SUPPLY_STATUS_CHARGING
+                                     : POWER_SUPPLY_STATUS_NOT_CHARGING;
+  return status;
+}
+
+/**
+ * max17048_status_at - Charging status reported for a reading
+ * @drv:   Driver data
+ * @tun:   Tunables in effect
+ * @crate: Raw signed C-Rate, ignored on chips without CRATE
+ * @soc:   State of charge in percent
+ *
+ * The one decode behind both the STATUS property and the poll work's
+ * uevent, display and hysteresis decisions. Chips without CRATE have no
+ * current direction to decode, so their status follows the adapter and
+ * the termination latch alone.
+ */
+static int max17048_status_at(struct max17048 *drv,
+                              const struct max17048_tunables *tun,
+                              int16_t crate, int soc) {
+  if (!drv->variant->has_crate)
+    return max17048_full_status(drv, READ_ONCE(drv->ac_online)
+                                         ? POWER_SUPPLY_STATUS_CHARGING
+                                         : POWER_SUPPLY_STATUS_DISCHARGING);
+  return max17048_full_status(drv, max17048_decode_status(tun, crate, soc));
+}
+
+/**
+ * max17048_level_at - Derive the capacity level
+ * @status: Charging status, see max17048_decode_status()
+ * @soc:    State of charge in percent
+ */
+static int max17048_level_at(int status, int soc) {
+  if (status == POWER_SUPPLY_STATUS_FULL || soc >= MAX17048_CAP_FULL_THR)
+    return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+  else if (soc <= MAX17048_CAP_CRIT_THR)
+    return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+  else if (soc <= MAX17048_CAP_LOW_THR)
+    return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+
+  return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+}
+
+/**
+ * max17048_tte_linear - Tuned linear time to empty
+ * @tun:   Tunables in effect
+ * @crate: Raw signed C-Rate
+ * @soc:   State of charge in percent
+ * @val:   Pointer to store TTE (seconds)
+ *
+ * Returns -ENODATA unless the battery is discharging.
+ */
+static int max17048_tte_linear(const struct max17048_tunables *tun,
+                               int16_t crate, int soc, int *val) {
+  int32_t discharge_rate;
+
+  if (crate >= -MAX17048_TTE_RATE_THR)
+    return -ENODATA;
+
+  discharge_rate = abs(crate);
+  /* TTE (s) = 225000 * soc / (discharge_rate * 13) */
+  /* Adjusted by tuning factor to match observed discharge profile */
+  *val = (int)div_s64((s64)MAX17048_TTE_CONST_NUM * soc *
+                          tun->tte_tuning_factor,
+                      (s64)discharge_rate * MAX17048_TTE_CONST_DEN);
+  return 0;
+}
+
+/**
+ * max17048_ttf_linear - Linear time to full
+ * @crate: Raw signed C-Rate
+ * @soc:   State of charge in percent
+ * @val:   Pointer to store TTF (seconds)
+ *
+ * Returns -ENODATA unless the battery is charging.
+ */
+static int max17048_ttf_linear(int16_t crate, int soc, int *val) {
+  if (crate <= MAX17048_TTE_RATE_THR)
+    return -ENODATA;
+
+  *val = (int)div_s64((s64)MAX17048_TTE_CONST_NUM * (100 - soc),
+                      (s64)crate * MAX17048_TTE_CONST_DEN);
+  return 0;
+}
+
+/**
+ * max17048_get_status - Get battery charging status
+ * @battery: Driver data
+ */
+static int max17048_get_status(struct max17048 *battery) {
+  struct max17048_tunables tun;
+  int16_t crate = 0;
+  int ret = 0, soc = 0;
+
+  max17048_get_tunables(battery, &tun);
+  if (battery->variant->has_crate)
+    ret = max17048_get_crate(battery, &crate);
+
+  /*
+   * Latched until the poll work confirms a discharge. A discharging read
+   * brings that confirmation forward instead of waiting for a heartbeat.
+   */
+  if (READ_ONCE(battery->full_latched) && READ_ONCE(battery->ac_online)) {
+    if (!ret && crate < -tun.crate_noise_thr) {
+      spin_lock_irq(&battery->cache_lock);
+      max17048_poll_sooner_locked(battery,
+                                  msecs_to_jiffies(MAX17048_AC_CONFIRM_MS));
+      spin_unlock_irq(&battery->cache_lock);
+    }
+    return POWER_SUPPLY_STATUS_FULL;
+  }
+
+  if (ret)
+    return POWER_SUPPLY_STATUS_UNKNOWN;
+
+  /* SOC only matters while the current is within the noise band */
+  if (battery->variant->has_crate && abs(crate) <= tun.crate_noise_thr)
+    soc = max17048_get_soc(battery);
+
+  return max17048_status_at(battery, &tun, crate, soc);
+}
+
+/*
+ * Typical single-cell LiPo open-circuit voltage at 0%, 10%, ... 100% SOC.
+ * Only the shape matters, the curve is shifted to match the measured OCV.
+ */
+static const int max17048_ocv_uv[] = {
+    3300000, 3600000, 3690000, 3740000, 3770000, 3800000,
+    3850000, 3920000, 4000000, 4090000, 4200000,
+};
+
+/**
+ * max17048_ocv_at - Interpolate the OCV curve
+ * @soc: State of charge in 1/256 %
+ */
+static int max17048_ocv_at(int soc) {
+  int step = 10 * MAX17048_SOC_LSB_INV;
+  int idx = clamp(soc, 0, MAX17048_SOC_FULL_FINE - 1) / step;
+  int frac = clamp(soc, 0, MAX17048_SOC_FULL_FINE) - idx * step;
+
+  return max17048_ocv_uv[idx] +
+         (max17048_ocv_uv[idx + 1] - max17048_ocv_uv[idx]) * frac / step;
+}
+
+/**
+ * max17048_pack_ocv_at - Interpolate the OCV curve for the whole pack
+ * @battery: Driver data
+ * @soc:     State of charge in 1/256 %
+ *
+ * VCELL of the dual-cell variants measures the series pair, so the
+ * single-cell curve is scaled to match.
+ */
+static int max17048_pack_ocv_at(struct max17048 *battery, int soc) {
+  return max17048_ocv_at(soc) * battery->variant->cells;
+}
+
+/**
+ * max17048_simulate_tte - Predict time to empty under the averaged load
+ * @battery: Driver data
+ * @now:     Latest sample
+ * @val:     Pointer to store TTE (seconds)
+ *
+ * Walks the OCV curve down from the present SOC until the loaded voltage,
+ * OCV minus the average load times the internal resistance, reaches the
+ * cutoff. Returns -EAGAIN if no resistance estimate exists yet and
+ * -ENODATA if the battery is not discharging on average.
+ */
+static int max17048_simulate_tte(struct max17048 *battery,
+                                 const struct max17048_sample *now, int *val) {
+  s64 load = 0, drop, offset;
+  int soc, prev_v, v, soc_empty;
+  unsigned int i, n;
+  u32 rint;
+
+  mutex_lock(&battery->lock);
+  rint = battery->rint_mohm;
+  n = battery->hist_len;
+  for (i = 0; i < n; i++)
+    load += battery->hist[i].crate;
+  mutex_unlock(&battery->lock);
+
+  if (!rint || !n)
+    return -EAGAIN;
+
+  load = -div_s64(load + now->crate, n + 1);
+  if (load <= MAX17048_TTE_RATE_THR)
+    return -ENODATA;
+  load = -max17048_crate_to_ua(battery, -load);
+
+  /* Align the curve with the OCV implied by the present reading */
+  offset = now->vcell_uv -
+           div_s64((s64)max17048_crate_to_ua(battery, now->crate) * rint,
+                   1000) -
+           max17048_pack_ocv_at(battery, now->soc);
+  drop = div_s64(load * rint, 1000);
+
+  soc_empty = 0;
+  prev_v = max17048_pack_ocv_at(battery, now->soc) + offset - drop;
+  if (prev_v <= battery->cutoff_uv) {
+    soc_empty = now->soc;
+  } else {
+    for (soc = now->soc - MAX17048_SOC_LSB_INV; soc > 0;
+         soc -= MAX17048_SOC_LSB_INV) {
+      v = max17048_pack_ocv_at(battery, soc) + offset - drop;
+      if (v <= battery->cutoff_uv) {
+        /* Interpolate inside the last 1% step */
+        soc_empty = soc + (int)div_s64((s64)(battery->cutoff_uv - v) *
+                                           MAX17048_SOC_LSB_INV,
+                                       prev_v - v);
+        break;
+      }
+      prev_v = v;
+    }
+  }
+
+  /* seconds = remaining uAh * 3600 / uA */
+  *val = (int)div64_s64((s64)(now->soc - soc_empty) *
+                            max17048_charge_full(battery) * 36,
+                        load * MAX17048_SOC_LSB_INV);
+  return 0;
+}
+
+/**
+ * max17048_get_time_to_empty - Estimate time to empty
+ * @battery: Driver data
+ * @val:     Pointer to store TTE (seconds)
+ *
+ * Uses the load-aware simulation once an internal resistance estimate is
+ * available, and the tuned linear estimate until then.
+ */
+static int max17048_get_time_to_empty(struct max17048 *battery, int *val) {
+  struct max17048_sample now;
+  struct max17048_tunables tun;
+  int ret;
+
+  ret = max17048_take_sample(battery, &now);
+  if (ret < 0)
+    return ret;
+
+  ret = max17048_simulate_tte(battery, &now, val);
+  if (ret != -EAGAIN)
+    return ret;
+
+  max17048_get_tunables(battery, &tun);
+  return max17048_tte_linear(&tun, now.crate, max17048_soc_to_pct(now.soc),
+                             val);
+}
+
+/**
+ * max17048_get_time_to_full - Estimate time to full
+ * @battery: Driver data
+ * @val:     Pointer to store TTF (seconds)
+ */
+static int max17048_get_time_to_full(struct max17048 *battery, int *val) {
+  int16_t crate;
+  int ret, soc;
+
+  ret = max17048_get_crate(battery, &crate);
+  if (ret)
+    return ret;
+
+  /* Skip the SOC read when not charging */
+  if (crate <= MAX17048_TTE_RATE_THR)
+    return -ENODATA;
+
+  soc = max17048_get_soc(battery);
+  if (soc < 0)
+    return soc;
+
+  return max17048_ttf_linear(crate, soc, val);
+}
+
+/**
+ * max17048_get_capacity_level - Get capacity level description
+ * @battery: Driver data
+ */
+static int max17048_get_capacity_level(struct max17048 *battery) {
+  struct max17048_tunables tun;
+  int16_t crate = 0;
+  int soc, status = POWER_SUPPLY_STATUS_UNKNOWN;
+
+  /* One SOC and one CRATE read, shared with the status decision */
+  soc = max17048_get_soc(battery);
+  if (soc < 0)
+    return POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN;
+
+  if (!battery->variant->has_crate || !max17048_get_crate(battery, &crate)) {
+    max17048_get_tunables(battery, &tun);
+    status = max17048_status_at(battery, &tun, crate, soc);
+  } else {
+    status = max17048_full_status(battery, status);
+  }
+
+  return max17048_level_at(status, soc);
+}
+
+/**
+ * max17048_learn_apply - Validate and install learned parameters
+ * @drv:         Driver data
+ * @charge_full: Full-charge capacity in uAh
+ * @cycles:      Cycle count
+ * @cycle_acc:   Discharged SOC towards the next cycle (1/256 %)
+ *
+ * Returns 0 on success, -EINVAL if the values are implausible.
+ */
+static int max17048_learn_apply(struct max17048 *drv, u32 charge_full,
+                                u32 cycles, u32 cycle_acc) {
+  u64 design = drv->charge_full_design_uah;
+
+  if ((u64)charge_full * 100 < design * MAX17048_LEARN_MIN_PCT ||
+      (u64)charge_full * 100 > design * MAX17048_LEARN_MAX_PCT ||
+      cycle_acc >= MAX17048_SOC_FULL_FINE)
+    return -EINVAL;
+
+  mutex_lock(&drv->lock);
+  drv->learn.charge_full_uah = charge_full;
+  drv->learn.cycle_count = cycles;
+  drv->learn.cycle_acc = cycle_acc;
+  mutex_unlock(&drv->lock);
+  return 0;
+}
+
+/**
+ * max17048_learn_save - Write the learned parameters to the nvmem cell
+ * @drv: Driver data
+ */
+static void max17048_learn_save(struct max17048 *drv) {
+  struct max17048_learn_blob blob;
+  int ret;
+
+  if (!drv->nvmem)
+    return;
+
+  mutex_lock(&drv->lock);
+  blob.magic = cpu_to_le32(MAX17048_LEARN_MAGIC);
+  blob.charge_full_uah = cpu_to_le32(drv->learn.charge_full_uah);
+  blob.cycle_count = cpu_to_le32(drv->learn.cycle_count);
+  blob.cycle_acc = cpu_to_le32(drv->learn.cycle_acc);
+  mutex_unlock(&drv->lock);
+
+  ret = nvmem_cell_write(drv->nvmem, &blob, sizeof(blob));
+  if (ret < 0)
+    dev_warn(drv->dev, "Failed to save learned params: %d\n", ret);
+}
+
+/**
+ * max17048_learn_restore - Load the learned parameters from the nvmem cell
+ * @drv: Driver data
+ */
+static void max17048_learn_restore(struct max17048 *drv) {
+  struct max17048_learn_blob *blob;
+  size_t len;
+
+  if (!drv->nvmem)
+    return;
+
+  blob = nvmem_cell_read(drv->nvmem, &len);
+  if (IS_ERR(blob))
+    return;
+
+  if (len >= sizeof(*blob) &&
+      le32_to_cpu(blob->magic) == MAX17048_LEARN_MAGIC &&
+      !max17048_learn_apply(drv, le32_to_cpu(blob->charge_full_uah),
+                            le32_to_cpu(blob->cycle_count),
+                            le32_to_cpu(blob->cycle_acc)))
+    dev_info(drv->dev, "Restored learned capacity %u uAh\n",
+             drv->learn.charge_full_uah);
+
+  kfree(blob);
+}
+
+/**
+ * max17048_learn_sample - Feed one sample into the cycle counter
+ * @drv:    Driver data
+ * @sample: New sample
+ *
+ * Called from the poll work. Accumulates the SOC discharged between
+ * samples and counts a cycle per 100% of it.
+ */
+static void max17048_learn_sample(struct max17048 *drv,
+                                  const struct max17048_sample *sample) {
+  struct max17048_learn *l = &drv->learn;
+  int soc = sample->soc;
+  bool dirty = false;
+
+  mutex_lock(&drv->lock);
+  if (l->last_soc >= 0 && soc < l->last_soc) {
+    l->cycle_acc += l->last_soc - soc;
+    if (l->cycle_acc >= MAX17048_SOC_FULL_FINE) {
+      l->cycle_acc -= MAX17048_SOC_FULL_FINE;
+      l->cycle_count++;
+      dirty = true;
+    }
+  }
+  l->last_soc = soc;
+  mutex_unlock(&drv->lock);
+
+  if (dirty)
+    max17048_learn_save(drv);
+}
+
+/**
+ * max17048_handle_reset - Handle a gauge power-on reset
+ * @drv:    Driver data
+ * @sample: Filled with a first sample of the restarted gauge
+ *
+ * STATUS.RI means the gauge has just started estimating SOC from scratch.
+ * Optionally force a quick-start so the estimate restarts from the
+ * present, relaxed cell voltage instead of converging slowly, then clear
+ * RI, drop the history and cycle counter baseline, and take a first
+ * sample once the gauge has settled. The caller records that sample.
+ *
+ * Returns 0 on success, error code on failure.
+ */
+static int max17048_handle_reset(struct max17048 *drv,
+                                 struct max17048_sample *sample) {
+  struct device *dev = drv->dev;
+  unsigned int cells = drv->variant->cells;
+  int ret, vcell;
+  bool qs = false;
+
+  if (quick_start) {
+    /* CRATE is not meaningful this early, so judge by voltage alone */
+    vcell = max17048_get_vcell(drv);
+    qs = vcell >= MAX17048_QSTART_MIN_UV * cells &&
+         vcell <= MAX17048_QSTART_MAX_UV * cells;
+    if (qs) {
+      ret = max17048_write_reg(drv, MAX17048_MODE_REG,
+                               MAX17048_MODE_QUICK_START);
+      if (ret)
+        return ret;
+      msleep(MAX17048_QSTART_SETTLE_MS);
+    }
+  }
+
+  ret = max17048_update_reg(drv, MAX17048_STATUS_REG, MAX17048_STATUS_RI,
+                            0);
+  if (ret)
+    return ret;
+
+  ret = max17048_take_sample(drv, sample);
+  if (ret)
+    return ret < 0 ? ret : -EIO;
+
+  /* Start cycle counting and history afresh from the new estimate */
+  mutex_lock(&drv->lock);
+  /* Readers take hist[0..hist_len) as the window, so refill from slot 0 */
+  drv->hist_head = 0;
+  drv->hist_len = 0;
+  drv->learn.last_soc = -1;
+  mutex_unlock(&drv->lock);
+
+  dev_info(dev, "Gauge reset%s: %d uV, SOC %d%%\n",
+           qs ? ", quick-started" : "", sample->vcell_uv,
+           sample->soc / MAX17048_SOC_LSB_INV);
+  return 0;
+}
+
+/**
+ * max17048_display_update - Advance the smoothed display SOC
+ * @drv:    Driver data
+ * @sample: New sample
+ *
+ * The display SOC never rises while discharging and never falls while
+ * charging, closes the gap to the gauge SOC by at most display_rate % per
+ * minute, and snaps to 100% once the battery is full. Load transients
+ * then no longer flip the reported percentage back and forth.
+ */
+static void max17048_display_update(struct max17048 *drv,
+                                    const struct max17048_sample *sample) {
+  struct max17048_tunables tun;
+  int status, target = sample->soc, cur, step;
+  s64 dt_ms;
+
+  max17048_get_tunables(drv, &tun);
+  status = max17048_status_at(drv, &tun, sample->crate,
+                              max17048_soc_to_pct(sample->soc));
+
+  mutex_lock(&drv->lock);
+  cur = drv->display_soc;
+  dt_ms = max_t(s64, ktime_ms_delta(sample->stamp, drv->display_stamp), 0);
+  drv->display_stamp = sample->stamp;
+
+  if (status == POWER_SUPPLY_STATUS_FULL) {
+    cur = MAX17048_SOC_FULL_FINE;
+  } else if (cur < 0 || !tun.display_rate) {
+    cur = target;
+  } else {
+    if (status == POWER_SUPPLY_STATUS_DISCHARGING)
+      target = min(target, cur);
+    else if (status == POWER_SUPPLY_STATUS_CHARGING)
+      target = max(target, cur);
+    step = (int)min_t(s64,
+                      div_s64(dt_ms * tun.display_rate * MAX17048_SOC_LSB_INV,
+                              60000),
+                      MAX17048_SOC_FULL_FINE);
+    cur += clamp(target - cur, -step, step);
+  }
+  WRITE_ONCE(drv->display_soc, cur);
+  mutex_unlock(&drv->lock);
+}
+
+/**
+ * max17048_ac_evidence - What one sample says about the charger
+ * @tun:   Tunables in effect
+ * @crate: Raw signed C-Rate
+ * @dv_uv: Per-cell VCELL change since the previous sample, 0 if unknown
+ *
+ * C-Rate outside the noise band decides. Within it, as near full or on
+ * chips without CRATE, a clear VCELL trend does.
+ *
+ * Returns 1 for charging, -1 for discharging, 0 if the sample says
+ * nothing either way.
+ */
+static int max17048_ac_evidence(const struct max17048_tunables *tun,
+                                int16_t crate, int dv_uv) {
+  if (crate > tun->crate_noise_thr)
+    return 1;
+  if (crate < -tun->crate_noise_thr)
+    return -1;
+  if (dv_uv >= MAX17048_AC_SLOPE_UV)
+    return 1;
+  if (dv_uv <= -MAX17048_AC_SLOPE_UV)
+    return -1;
+  return 0;
+}
+
+/**
+ * max17048_ac_update - Advance the AC presence state machine
+ * @drv:    Driver data
+ * @sample: New sample
+ *
+ * A charger-detect GPIO, if wired, is authoritative. Otherwise the state
+ * follows the first sample and afterwards only changes once ac_debounce
+ * consecutive samples contradict it, so a load spike while charging does
+ * not take the adapter offline. A sample that agrees or is inconclusive
+ * cancels a pending change.
+ */
+static void max17048_ac_update(struct max17048 *drv,
+                               const struct max17048_sample *sample) {
+  struct max17048_tunables tun;
+  int ev, online, dv;
+
+  if (drv->ac_gpio) {
+    online = gpiod_get_value_cansleep(drv->ac_gpio);
+    if (online >= 0)
+      WRITE_ONCE(drv->ac_online, online);
+    return;
+  }
+
+  max17048_get_tunables(drv, &tun);
+  dv = drv->ac_last_uv ? (sample->vcell_uv - drv->ac_last_uv) /
+                            (int)drv->variant->cells
+                      : 0;
+  ev = max17048_ac_evidence(&tun, sample->crate, dv);
+
+  if (!drv->ac_last_uv) {
+    /* Without CRATE the first sample says nothing, VCELL trends decide */
+    online = drv->variant->has_crate
+                 ? max17048_decode_status(&tun, sample->crate,
+                                          max17048_soc_to_pct(sample->soc))
+                 : POWER_SUPPLY_STATUS_DISCHARGING;
+    WRITE_ONCE(drv->ac_online, online == POWER_SUPPLY_STATUS_CHARGING ||
+                                   online == POWER_SUPPLY_STATUS_FULL);
+  } else if (ev == (drv->ac_online ? -1 : 1)) {
+    if (++drv->ac_votes >= tun.ac_debounce) {
+      WRITE_ONCE(drv->ac_online, !drv->ac_online);
+      drv->ac_votes = 0;
+    }
+  } else {
+    drv->ac_votes = 0;
+  }
+  drv->ac_last_uv = sample->vcell_uv;
+}
+
+/**
+ * max17048_full_update - Windowed charge termination detection
+ * @drv:    Driver data
+ * @sample: New sample
+ *
+ * Termination is latched after term_samples consecutive samples with the
+ * adapter present, SOC at or above full_soc_thr, VCELL on a plateau
+ * within MAX17048_TERM_MARGIN_UV per cell of the charge voltage, and the
+ * C-Rate tapered to between the noise band and term_crate. It is released
+ * as soon as the adapter is gone, or after term_samples consecutive
+ * discharging samples with it present, so top-off pulses and load spikes
+ * at full do not toggle the status.
+ */
+static void max17048_full_update(struct max17048 *drv,
+                                 const struct max17048_sample *sample) {
+  struct max17048_tunables tun;
+  bool ac_online = READ_ONCE(drv->ac_online);
+  bool toggle;
+  int dv;
+
+  max17048_get_tunables(drv, &tun);
+  dv = drv->full_last_uv ? sample->vcell_uv - drv->full_last_uv : 0;
+  drv->full_last_uv = sample->vcell_uv;
+
+  if (drv->full_latched) {
+    if (!ac_online) {
+      drv->full_votes = 0;
+      WRITE_ONCE(drv->full_latched, false);
+      return;
+    }
+    toggle = sample->crate < -tun.crate_noise_thr;
+  } else {
+    toggle = ac_online &&
+             max17048_soc_to_pct(sample->soc) >= tun.full_soc_thr &&
+             sample->vcell_uv >= (int)(drv->vmax_uv -
+                                       MAX17048_TERM_MARGIN_UV *
+                                           drv->variant->cells) &&
+             dv < MAX17048_TERM_SLOPE_UV * (int)drv->variant->cells &&
+             sample->crate >= -tun.crate_noise_thr &&
+             sample->crate <= tun.term_crate;
+  }
+
+  if (!toggle) {
+    drv->full_votes = 0;
+  } else if (++drv->full_votes >= tun.term_samples) {
+    drv->full_votes = 0;
+    WRITE_ONCE(drv->full_latched, !drv->full_latched);
+  }
+}
+
+/**
+ * max17048_record_sample - Feed a polled sample to history and counters
+ * @drv:    Driver data
+ * @sample: New sample, replaced by a fresh one if the gauge had reset
+ */
+static void max17048_record_sample(struct max17048 *drv,
+                                   struct max17048_sample *sample) {
+  struct max17048_sample fresh;
+  int ret;
+
+  trace_max17048_publish(max17048_name(drv), sample->vcell_uv, sample->soc,
+                         sample->crate, sample->status);
+
+  if (sample->status & MAX17048_STATUS_RI) {
+    /* The restarted gauge's first sample replaces the one that saw RI */
+    ret = max17048_handle_reset(drv, &fresh);
+    if (!ret) {
+      *sample = fresh;
+      trace_max17048_publish(max17048_name(drv), sample->vcell_uv,
+                             sample->soc, sample->crate, sample->status);
+    } else {
+      dev_warn(drv->dev, "Failed to handle gauge reset: %d\n", ret);
+    }
+  }
+
+  max17048_hist_push(drv, sample);
+  max17048_learn_sample(drv, sample);
+  /* Termination needs the AC state, the display SOC the termination */
+  max17048_ac_update(drv, sample);
+  max17048_full_update(drv, sample);
+  max17048_display_update(drv, sample);
+}
+
+/**
+ * max17048_get_property - Resolve one battery property
+ * @battery: Driver data
+ * @psp:     Property
+ * @val:     Property value
+ */
+static int max17048_get_property(struct max17048 *battery,
+                                 enum power_supply_property psp,
+                                 union power_supply_propval *val) {
   int ret;
 
   switch (psp) {
@@ -302,7 +2297,23 @@ static int battery_get_property(struct power_supply *psy,
       return ret;
     val->intval = ret;
     break;
+  case POWER_SUPPLY_PROP_VOLTAGE_AVG:
+    ret = max17048_hist_summary(battery, NULL, &val->intval, NULL);
+    if (ret < 0)
+      return ret;
+    break;
+  case POWER_SUPPLY_PROP_VOLTAGE_OCV:
+    ret = max17048_get_ocv(battery, &val->intval);
+    if (ret < 0)
+      return ret;
+    break;
   case POWER_SUPPLY_PROP_CAPACITY:
+    /* The smoothed value, if enabled, only changes with the poll work */
+    if (READ_ONCE(battery->tun.display_rate) &&
+        READ_ONCE(battery->display_soc) >= 0) {
+      val->intval = READ_ONCE(battery->display_soc) / MAX17048_SOC_LSB_INV;
+      break;
+    }
     ret = max17048_get_soc(battery);
     if (ret < 0)
       return ret;
@@ -315,19 +2326,27 @@ static int battery_get_property(struct power_supply *psy,
     ret = max17048_get_soc(battery);
     if (ret < 0)
       return ret;
-    val->intval = (int)div_s64((s64)ret * battery->charge_full_design_uah, 100);
+    val->intval = (int)div_s64((s64)ret * max17048_charge_full(battery), 100);
+    break;
+  case POWER_SUPPLY_PROP_CHARGE_FULL:
+    val->intval = (int)max17048_charge_full(battery);
     break;
   case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
     val->intval = (int)battery->charge_full_design_uah;
     break;
+  case POWER_SUPPLY_PROP_CYCLE_COUNT:
+    val->intval = (int)READ_ONCE(battery->learn.cycle_count);
+    break;
   case POWER_SUPPLY_PROP_ENERGY_NOW:
     ret = max17048_get_soc(battery);
     if (ret < 0)
       return ret;
     /* Estimate Energy Now based on SOC and Energy Full */
-    val->intval = (int)div_s64((s64)ret * battery->energy_full_design_uwh, 100);
+    val->intval = (int)div_s64((s64)ret * max17048_energy_full(battery), 100);
     break;
   case POWER_SUPPLY_PROP_ENERGY_FULL:
+    val->intval = (int)max17048_energy_full(battery);
+    break;
   case POWER_SUPPLY_PROP_ENERGY_FULL_DESIGN:
     val->intval = (int)battery->energy_full_design_uwh;
     break;
@@ -339,6 +2358,16 @@ static int battery_get_property(struct power_supply *psy,
     if (ret < 0)
       return ret;
     break;
+  case POWER_SUPPLY_PROP_POWER_NOW:
+    ret = max17048_get_power_now(battery, &val->intval);
+    if (ret < 0)
+      return ret;
+    break;
+  case POWER_SUPPLY_PROP_POWER_AVG:
+    ret = max17048_hist_summary(battery, NULL, NULL, &val->intval);
+    if (ret < 0)
+      return ret;
+    break;
   case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
     ret = max17048_get_time_to_empty(battery, &val->intval);
     if (ret < 0)
@@ -350,13 +2379,13 @@ static int battery_get_property(struct power_supply *psy,
       return ret;
     break;
   case POWER_SUPPLY_PROP_MODEL_NAME:
-    val->strval = "MAX17048";
+    val->strval = battery->variant->model;
     break;
   case POWER_SUPPLY_PROP_MANUFACTURER:
     val->strval = "Maxim Integrated";
     break;
   case POWER_SUPPLY_PROP_PRESENT:
-    val->intval = 1;
+    val->intval = !max17048_offline(battery);
     break;
   default:
     return -EINVAL;
@@ -367,15 +2396,21 @@ static int battery_get_property(struct power_supply *psy,
 static enum power_supply_property max17048_battery_props[] = {
     POWER_SUPPLY_PROP_STATUS,
     POWER_SUPPLY_PROP_VOLTAGE_NOW,
+    POWER_SUPPLY_PROP_VOLTAGE_AVG,
+    POWER_SUPPLY_PROP_VOLTAGE_OCV,
     POWER_SUPPLY_PROP_CAPACITY,
     POWER_SUPPLY_PROP_CAPACITY_LEVEL,
     POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
+    POWER_SUPPLY_PROP_CHARGE_FULL,
     POWER_SUPPLY_PROP_CHARGE_NOW,
+    POWER_SUPPLY_PROP_CYCLE_COUNT,
     POWER_SUPPLY_PROP_ENERGY_NOW,
     POWER_SUPPLY_PROP_ENERGY_FULL,
     POWER_SUPPLY_PROP_ENERGY_FULL_DESIGN,
     POWER_SUPPLY_PROP_TECHNOLOGY,
     POWER_SUPPLY_PROP_CURRENT_NOW,
+    POWER_SUPPLY_PROP_POWER_NOW,
+    POWER_SUPPLY_PROP_POWER_AVG,
     POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
     POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
     POWER_SUPPLY_PROP_MODEL_NAME,
@@ -383,6 +2418,70 @@ static enum power_supply_property max17048_battery_props[] = {
     POWER_SUPPLY_PROP_PRESENT,
 };
 
+/* Without CRATE there is no current, power, OCV or time estimate */
+static enum power_supply_property max17043_battery_props[] = {
+    POWER_SUPPLY_PROP_STATUS,
+    POWER_SUPPLY_PROP_VOLTAGE_NOW,
+    POWER_SUPPLY_PROP_VOLTAGE_AVG,
+    POWER_SUPPLY_PROP_CAPACITY,
+    POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+    POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
+    POWER_SUPPLY_PROP_CHARGE_FULL,
+    POWER_SUPPLY_PROP_CHARGE_NOW,
+    POWER_SUPPLY_PROP_CYCLE_COUNT,
+    POWER_SUPPLY_PROP_ENERGY_NOW,
+    POWER_SUPPLY_PROP_ENERGY_FULL,
+    POWER_SUPPLY_PROP_ENERGY_FULL_DESIGN,
+    POWER_SUPPLY_PROP_TECHNOLOGY,
+    POWER_SUPPLY_PROP_MODEL_NAME,
+    POWER_SUPPLY_PROP_MANUFACTURER,
+    POWER_SUPPLY_PROP_PRESENT,
+};
+
+/**
+ * battery_get_property - Power Supply API get_property callback
+ *
+ * Counts whether the read reached the bus for the debugfs statistics. A
+ * transfer by the poll work running at the same moment is attributed to
+ * the property as well, which is rare enough not to matter.
+ */
+static int battery_get_property(struct power_supply *psy,
+                                enum power_supply_property psp,
+                                union power_supply_propval *val) {
+  struct max17048 *battery = power_supply_get_drvdata(psy);
+  struct max17048_stats *st = &battery->stats;
+  unsigned long flags;
+  u64 xfers;
+  int i, ret;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  xfers = st->xfers;
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+
+  ret = max17048_get_property(battery, psp, val);
+  if (trace_max17048_property_enabled()) {
+    bool str = psp == POWER_SUPPLY_PROP_MODEL_NAME ||
+               psp == POWER_SUPPLY_PROP_MANUFACTURER;
+
+    trace_max17048_property(max17048_name(battery), psp, ret,
+                            ret || str ? 0 : val->intval);
+  }
+
+  for (i = 0; i < ARRAY_SIZE(max17048_battery_props); i++)
+    if (max17048_battery_props[i] == psp)
+      break;
+
+  spin_lock_irqsave(&battery->cache_lock, flags);
+  if (i < ARRAY_SIZE(max17048_battery_props) && st->prop_hit) {
+    if (st->xfers == xfers)
+      st->prop_hit[i]++;
+    else
+      st->prop_miss[i]++;
+  }
+  spin_unlock_irqrestore(&battery->cache_lock, flags);
+  return ret;
+}
+
 static const struct power_supply_desc max17048_battery_desc = {
     .name = "battery",
     .type = POWER_SUPPLY_TYPE_BATTERY,
@@ -395,69 +2494,960 @@ static int max17048_ac_get_property(struct power_supply *psy,
                                     enum power_supply_property psp,
                                     union power_supply_propval *val) {
   struct max17048 *drv = power_supply_get_drvdata(psy);
+
+  switch (psp) {
+  case POWER_SUPPLY_PROP_ONLINE:
+    /* Debounced by the poll work, see max17048_ac_update() */
+    val->intval = READ_ONCE(drv->ac_online);
+    break;
+  default:
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static enum power_supply_property max17048_ac_props[] = {
+    POWER_SUPPLY_PROP_ONLINE,
+};
+
+static const struct power_supply_desc max17048_ac_desc = {
+    .name = "max17048-mains",
+    .type = POWER_SUPPLY_TYPE_MAINS,
+    .get_property = max17048_ac_get_property,
+    .properties = max17048_ac_props,
+    .num_properties = ARRAY_SIZE(max17048_ac_props),
+};
+
+/*
+ * state_of_health: restored capacity as a percentage of design capacity.
+ * The gauge cannot measure fade itself, so this stays at 100 until a
+ * capacity measured elsewhere (e.g. by a charger) is written below.
+ * learned_params: "<charge_full_uah> <cycle_count> <cycle_acc>", readable
+ * so userspace can save it and writable so it can be restored on boards
+ * without an nvmem cell.
+ */
+static ssize_t state_of_health_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+
+  return sysfs_emit(buf, "%u\n",
+                    (u32)div_u64((u64)max17048_charge_full(drv) * 100,
+                                 drv->charge_full_design_uah));
+}
+static DEVICE_ATTR_RO(state_of_health);
+
+static ssize_t learned_params_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+  ssize_t len;
+
+  mutex_lock(&drv->lock);
+  len = sysfs_emit(buf, "%u %u %u\n", drv->learn.charge_full_uah,
+                   drv->learn.cycle_count, drv->learn.cycle_acc);
+  mutex_unlock(&drv->lock);
+  return len;
+}
+
+static ssize_t learned_params_store(struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+  u32 charge_full, cycles, cycle_acc;
+  int ret;
+
+  if (sscanf(buf, "%u %u %u", &charge_full, &cycles, &cycle_acc) != 3)
+    return -EINVAL;
+
+  ret = max17048_learn_apply(drv, charge_full, cycles, cycle_acc);
+  if (ret)
+    return ret;
+
+  max17048_learn_save(drv);
+  power_supply_changed(drv->battery);
+  return count;
+}
+static DEVICE_ATTR_RW(learned_params);
+
+/* internal_resistance: estimated cell resistance in milliohms, 0 if unknown */
+static ssize_t internal_resistance_show(struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+
+  return sysfs_emit(buf, "%u\n", READ_ONCE(drv->rint_mohm));
+}
+static DEVICE_ATTR_RO(internal_resistance);
+
+/* stale: 1 while values are served from the last known good readings */
+static ssize_t stale_show(struct device *dev, struct device_attribute *attr,
+                          char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+
+  return sysfs_emit(buf, "%d\n", READ_ONCE(drv->stale));
+}
+static DEVICE_ATTR_RO(stale);
+
+/* bus_errors: transfer failures by class, retries and bus recoveries */
+static ssize_t bus_errors_show(struct device *dev,
+                               struct device_attribute *attr, char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+  struct max17048_bus_stats st;
+
+  spin_lock_irq(&drv->cache_lock);
+  st = drv->bus_stats;
+  spin_unlock_irq(&drv->cache_lock);
+
+  return sysfs_emit(buf,
+                    "nack: %u\ntimeout: %u\narbitration: %u\nio: %u\n"
+                    "other: %u\nretries: %u\nrecoveries: %u\n",
+                    st.nack, st.timeout, st.arbitration, st.io, st.other,
+                    st.retries, st.recoveries);
+}
+static DEVICE_ATTR_RO(bus_errors);
+
+/* absorbed_reads: register reads answered within min_read_interval_ms */
+static ssize_t absorbed_reads_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+  u64 absorbed;
+
+  spin_lock_irq(&drv->cache_lock);
+  absorbed = drv->absorbed_reads;
+  spin_unlock_irq(&drv->cache_lock);
+
+  return sysfs_emit(buf, "%llu\n", absorbed);
+}
+static DEVICE_ATTR_RO(absorbed_reads);
+
+/* capacity_raw: gauge SOC in %, whether or not CAPACITY is smoothed */
+static ssize_t capacity_raw_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+  int soc = max17048_get_soc(drv);
+
+  if (soc < 0)
+    return soc;
+  return sysfs_emit(buf, "%d\n", soc);
+}
+static DEVICE_ATTR_RO(capacity_raw);
+
+/*
+ * suspend_drain: drain rates of past suspends in 1/1000 % per hour, with
+ * a log2 histogram. suspend_time_to_empty: seconds the present charge
+ * would last suspended at the average rate.
+ */
+static ssize_t suspend_drain_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+  struct max17048_drain *d = &drv->drain;
+  ssize_t len;
+  int i;
+
+  mutex_lock(&drv->lock);
+  len = sysfs_emit(buf,
+                   "count: %u\nlast_mpct_per_h: %u\nlast_uv: %d\n"
+                   "avg_mpct_per_h: %u\nhist:",
+                   d->count, d->last_rate, d->last_uv, d->avg_rate);
+  for (i = 0; i < MAX17048_DRAIN_BUCKETS; i++)
+    len += sysfs_emit_at(buf, len, " %u", d->hist[i]);
+  len += sysfs_emit_at(buf, len, "\n");
+  mutex_unlock(&drv->lock);
+  return len;
+}
+static DEVICE_ATTR_RO(suspend_drain);
+
+static ssize_t suspend_time_to_empty_show(struct device *dev,
+                                          struct device_attribute *attr,
+                                          char *buf) {
+  struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));
+  int soc = max17048_get_soc_fine(drv);
+  u32 rate;
+
+  if (soc < 0)
+    return soc;
+
+  mutex_lock(&drv->lock);
+  rate = drv->drain.avg_rate;
+  mutex_unlock(&drv->lock);
+  if (!rate)
+    return -ENODATA;
+
+  /* 1/256 % -> m%, then hours -> seconds */
+  return sysfs_emit(buf, "%llu\n",
+                    div_u64((u64)soc * 1000 * 3600 / MAX17048_SOC_LSB_INV,
+                            rate));
+}
+static DEVICE_ATTR_RO(suspend_time_to_empty);
+
+/*
+ * Runtime tunables. Each write is range checked and swapped in under the
+ * cache lock. A shorter poll interval takes effect immediately; nothing
+ * postpones a run that is already due earlier, such as an AC confirmation,
+ * an offline probe or a touch deadline.
+ */
+static int max17048_set_tunable(struct max17048 *drv, int *field,
+                                const char *buf, int min, int max) {
+  int val, ret;
+
+  ret = kstrtoint(buf, 0, &val);
+  if (ret)
+    return ret;
+  if (val < min || val > max)
+    return -EINVAL;
+
+  spin_lock_irq(&drv->cache_lock);
+  *field = val;
+  if (field == &drv->tun.poll_ms || field == &drv->tun.poll_irq_ms)
+    max17048_poll_sooner_locked(drv, max17048_poll_delay_locked(drv));
+  spin_unlock_irq(&drv->cache_lock);
+  return 0;
+}
+
+#define MAX17048_TUNABLE_ATTR(_name, _min, _max)                               \
+  static ssize_t _name##_show(struct device *dev,                              \
+                              struct device_attribute *attr, char *buf) {      \
+    struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));    \
+    struct max17048_tunables tun;                                              \
+                                                                               \
+    max17048_get_tunables(drv, &tun);                                          \
+    return sysfs_emit(buf, "%d\n", tun._name);                                 \
+  }                                                                            \
+  static ssize_t _name##_store(struct device *dev,                             \
+                               struct device_attribute *attr, const char *buf, \
+                               size_t count) {                                 \
+    struct max17048 *drv = power_supply_get_drvdata(dev_get_drvdata(dev));    \
+    int ret;                                                                   \
+                                                                               \
+    ret = max17048_set_tunable(drv, &drv->tun._name, buf, _min, _max);         \
+    return ret ?: count;                                                       \
+  }                                                                            \
+  static DEVICE_ATTR_RW(_name)
+
+MAX17048_TUNABLE_ATTR(crate_noise_thr, 0, 1000);
+MAX17048_TUNABLE_ATTR(full_soc_thr, 50, 100);
+MAX17048_TUNABLE_ATTR(tte_tuning_factor, 1, 64);
+MAX17048_TUNABLE_ATTR(poll_ms, MAX17048_MIN_POLL_MS, MAX17048_MAX_POLL_MS);
+MAX17048_TUNABLE_ATTR(poll_irq_ms, MAX17048_MIN_POLL_MS, MAX17048_MAX_POLL_MS);
+MAX17048_TUNABLE_ATTR(soc_hyst, 0, MAX17048_MAX_SOC_HYST);
+MAX17048_TUNABLE_ATTR(display_rate, 0, MAX17048_MAX_DISPLAY_RATE);
+MAX17048_TUNABLE_ATTR(ac_debounce, 1, MAX17048_MAX_AC_DEBOUNCE);
+MAX17048_TUNABLE_ATTR(term_crate, 0, 1000);
+MAX17048_TUNABLE_ATTR(term_samples, 1, MAX17048_MAX_TERM_SAMPLES);
+
+static struct attribute *max17048_battery_attrs[] = {
+    &dev_attr_state_of_health.attr,
+    &dev_attr_learned_params.attr,
+    &dev_attr_internal_resistance.attr,
+    &dev_attr_stale.attr,
+    &dev_attr_bus_errors.attr,
+    &dev_attr_absorbed_reads.attr,
+    &dev_attr_suspend_drain.attr,
+    &dev_attr_suspend_time_to_empty.attr,
+    &dev_attr_crate_noise_thr.attr,
+    &dev_attr_full_soc_thr.attr,
+    &dev_attr_tte_tuning_factor.attr,
+    &dev_attr_poll_ms.attr,
+    &dev_attr_poll_irq_ms.attr,
+    &dev_attr_soc_hyst.attr,
+    &dev_attr_display_rate.attr,
+    &dev_attr_ac_debounce.attr,
+    &dev_attr_term_crate.attr,
+    &dev_attr_term_samples.attr,
+    &dev_attr_capacity_raw.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(max17048_battery);
+
+/**
+ * max17048_reschedule - Arm the poll work
+ * @drv:    Driver data
+ * @reason: Why, for the trace event
+ * @delay:  Delay in jiffies
+ */
+static void max17048_reschedule(struct max17048 *drv, const char *reason,
+                                unsigned long delay) {
+  trace_max17048_poll(max17048_name(drv), reason, jiffies_to_msecs(delay));
+  schedule_delayed_work(&drv->work, delay);
+}
+
+/**
+ * max17048_touch_defer - Postpone a refresh while the touchscreen is busy
+ * @drv: Driver data
+ *
+ * Gauge transfers on the bit-banged bus hold off the touchscreen's reads,
+ * so a refresh waits for a quiet window after the last touch event. A
+ * deadline bounds how stale battery data can get during long drags.
+ *
+ * Returns true if the refresh has been rescheduled.
+ */
+static bool max17048_touch_defer(struct max17048 *drv) {
+  unsigned long quiet = msecs_to_jiffies(READ_ONCE(touch_quiet_ms));
+  unsigned long idle_at = READ_ONCE(drv->last_touch) + quiet;
+  unsigned long now = jiffies;
+
+  if (!quiet || !time_before(now, idle_at)) {
+    drv->deferring = false;
+    return false;
+  }
+
+  if (!drv->deferring) {
+    drv->deferring = true;
+    drv->defer_since = now;
+  } else if (time_after_eq(now, drv->defer_since +
+                                    msecs_to_jiffies(READ_ONCE(
+                                        touch_max_defer_ms)))) {
+    drv->deferring = false;
+    return false;
+  }
+
+  max17048_reschedule(drv, "touch", idle_at - now);
+  return true;
+}
+
+static void max17048_touch_event(struct input_handle *handle,
+                                 unsigned int type, unsigned int code,
+                                 int value) {
+  struct max17048 *drv = handle->handler->private;
+
+  WRITE_ONCE(drv->last_touch, jiffies);
+}
+
+static int max17048_touch_connect(struct input_handler *handler,
+                                  struct input_dev *dev,
+                                  const struct input_device_id *id) {
+  struct input_handle *handle;
+  int ret;
+
+  handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+  if (!handle)
+    return -ENOMEM;
+
+  handle->dev = dev;
+  handle->handler = handler;
+  handle->name = handler->name;
+
+  ret = input_register_handle(handle);
+  if (ret)
+    goto err_free;
+
+  ret = input_open_device(handle);
+  if (ret)
+    goto err_unregister;
+
+  return 0;
+
+err_unregister:
+  input_unregister_handle(handle);
+err_free:
+  kfree(handle);
+  return ret;
+}
+
+static void max17048_touch_disconnect(struct input_handle *handle) {
+  input_close_device(handle);
+  input_unregister_handle(handle);
+  kfree(handle);
+}
+
+/* Multi-touch screens, such as the edt-ft5406 sharing the gauge's bus */
+static const struct input_device_id max17048_touch_ids[] = {
+    {
+        .flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_ABSBIT,
+        .evbit = {BIT_MASK(EV_ABS)},
+        .absbit = {[BIT_WORD(ABS_MT_POSITION_X)] =
+                       BIT_MASK(ABS_MT_POSITION_X)},
+    },
+    {},
+};
+
+/**
+ * max17048_should_notify - Decide whether a sample is worth a uevent
+ * @drv:    Driver data
+ * @sample: New sample
+ *
+ * Status changes always notify; SOC has to move by the configured
+ * hysteresis. A hysteresis of 0 notifies on every poll.
+ */
+static bool max17048_should_notify(struct max17048 *drv,
+                                   const struct max17048_sample *sample) {
+  int soc = sample->soc / MAX17048_SOC_LSB_INV;
+  struct max17048_tunables tun;
+  bool notify;
   int status;
 
-  switch (psp) {
-  case POWER_SUPPLY_PROP_ONLINE:
-    status = max17048_get_status(drv);
-    val->intval = (status == POWER_SUPPLY_STATUS_CHARGING ||
-                   status == POWER_SUPPLY_STATUS_FULL);
-    break;
-  default:
-    return -EINVAL;
+  max17048_get_tunables(drv, &tun);
+  status = max17048_status_at(drv, &tun, sample->crate, soc);
+  /* Hysteresis applies to what CAPACITY reports */
+  if (tun.display_rate)
+    soc = READ_ONCE(drv->display_soc) / MAX17048_SOC_LSB_INV;
+
+  notify = !drv->notified || status != drv->notify_status ||
+           abs(soc - drv->notify_soc) >= tun.soc_hyst;
+  /* The values just weighed, not the last ones announced */
+  trace_max17048_uevent(max17048_name(drv), notify, soc, status);
+  if (!notify)
+    return false;
+
+  drv->notified = true;
+  drv->notify_soc = soc;
+  drv->notify_status = status;
+  return true;
+}
+
+static void max17048_work(struct work_struct *work) {
+  struct max17048 *drv = container_of(work, struct max17048, work.work);
+  struct max17048_sample sample;
+  bool was_offline = drv->offline_reported;
+  bool ac_online = READ_ONCE(drv->ac_online);
+  enum max17048_health health;
+  bool notify = false;
+  u64 start;
+  int ret;
+
+  spin_lock_irq(&drv->cache_lock);
+  drv->stats.wakeups++;
+  spin_unlock_irq(&drv->cache_lock);
+
+  if (max17048_touch_defer(drv))
+    return;
+
+  if (max17048_offline(drv)) {
+    /* Report PRESENT=0 once, then probe with exponential backoff */
+    if (was_offline && max17048_probe_bus(drv)) {
+      drv->backoff_ms =
+          min(drv->backoff_ms * 2, (unsigned int)MAX17048_BACKOFF_MAX_MS);
+      max17048_reschedule(drv, "backoff", msecs_to_jiffies(drv->backoff_ms));
+      return;
+    }
+    if (!was_offline) {
+      drv->offline_reported = true;
+      drv->notified = false;
+      power_supply_changed(drv->battery);
+      power_supply_changed(drv->ac_adapter);
+      max17048_reschedule(drv, "backoff", msecs_to_jiffies(drv->backoff_ms));
+      return;
+    }
+  }
+  drv->offline_reported = false;
+
+  /* A replay moves on by exactly one record per refresh */
+  if (drv->sim && max17048_replay_step(drv->sim))
+    max17048_cache_expire(drv);
+
+  health = READ_ONCE(drv->health);
+  start = ktime_get_ns();
+  ret = max17048_take_sample(drv, &sample);
+  trace_max17048_refresh(max17048_name(drv), drv->wide_burst, ret,
+                         ktime_get_ns() - start);
+  if (!ret) {
+    max17048_record_sample(drv, &sample);
+    notify = max17048_should_notify(drv, &sample);
+  }
+  /*
+   * Stale or failed samples hold nothing new, only a gauge that came
+   * back or changed health is worth telling userspace about.
+   */
+  if (was_offline || READ_ONCE(drv->health) != health)
+    notify = true;
+  spin_lock_irq(&drv->cache_lock);
+  if (notify)
+    drv->stats.uevents++;
+  else
+    drv->stats.suppressed++;
+  spin_unlock_irq(&drv->cache_lock);
+
+  if (notify)
+    power_supply_changed(drv->battery);
+  /* The adapter only announces real state changes */
+  if (READ_ONCE(drv->ac_online) != ac_online)
+    power_supply_changed(drv->ac_adapter);
+
+  if (drv->ac_votes || (drv->full_latched && drv->full_votes))
+    max17048_reschedule(drv, drv->ac_votes ? "ac-confirm" : "full-confirm",
+                        min(max17048_poll_delay(drv),
+                            msecs_to_jiffies(MAX17048_AC_CONFIRM_MS)));
+  else
+    max17048_reschedule(drv, "poll", max17048_poll_delay(drv));
+}
+
+/**
+ * max17048_ack_status - Clear the latched alert and release ALRT
+ * @drv:    Driver data
+ * @status: STATUS at the time of the alert
+ *
+ * Bypasses the rate limit so the flags are the ones that raised the
+ * interrupt. Reading STATUS does not release the pin: the alert flags are
+ * written back as 0 and CONFIG.ALRT is cleared, otherwise the level
+ * interrupt fires again as soon as it is unmasked. RI stays set for
+ * max17048_handle_reset(), which the poll work is kicked to run.
+ */
+static int max17048_ack_status(struct max17048 *drv, u16 *status) {
+  int ret;
+
+  ret = max17048_xfer_read(drv, MAX17048_STATUS_REG, status, 1);
+  max17048_bus_done(drv, ret);
+  if (ret)
+    return ret;
+  max17048_cache_store(drv, MAX17048_STATUS_REG, status, 1);
+
+  if (*status & MAX17048_STATUS_ALERTS) {
+    ret = max17048_update_reg(drv, MAX17048_STATUS_REG,
+                              *status & MAX17048_STATUS_ALERTS, 0);
+    if (ret)
+      return ret;
+  }
+
+  if (*status & MAX17048_STATUS_RI) {
+    spin_lock_irq(&drv->cache_lock);
+    max17048_poll_sooner_locked(drv, 0);
+    spin_unlock_irq(&drv->cache_lock);
+  }
+
+  return max17048_update_reg(drv, MAX17048_CONFIG_REG, MAX17043_CONFIG_ALRT,
+                             0);
+}
+
+/**
+ * max17043_ack_config - Clear ALRT on chips without STATUS
+ * @drv:    Driver data
+ * @status: Set to 0, the only alert is low SOC
+ */
+static int max17043_ack_config(struct max17048 *drv, u16 *status) {
+  *status = 0;
+  return max17048_update_reg(drv, MAX17048_CONFIG_REG, MAX17043_CONFIG_ALRT,
+                             0);
+}
+
+static irqreturn_t max17048_irq_handler(int irq, void *dev_id) {
+  struct max17048 *drv = dev_id;
+  int ret;
+  u16 status = 0;
+
+  ret = drv->variant->ack_alert(drv, &status);
+  trace_max17048_alert(max17048_name(drv), ret, status);
+
+  power_supply_changed(drv->battery);
+  return IRQ_HANDLED;
+}
+
+/**
+ * max17048_ac_irq_handler - Charger-detect edge
+ * @irq:    Interrupt number
+ * @dev_id: Driver data
+ *
+ * Reports the adapter at once and refreshes the battery shortly after,
+ * once the gauge has seen the current change.
+ */
+static irqreturn_t max17048_ac_irq_handler(int irq, void *dev_id) {
+  struct max17048 *drv = dev_id;
+  int online;
+
+  online = gpiod_get_value_cansleep(drv->ac_gpio);
+  if (online < 0 || online == READ_ONCE(drv->ac_online))
+    return IRQ_HANDLED;
+
+  WRITE_ONCE(drv->ac_online, online);
+  power_supply_changed(drv->ac_adapter);
+
+  spin_lock_irq(&drv->cache_lock);
+  if (drv->polling)
+    mod_delayed_work(system_wq, &drv->work,
+                     msecs_to_jiffies(MAX17048_AC_CONFIRM_MS));
+  spin_unlock_irq(&drv->cache_lock);
+  return IRQ_HANDLED;
+}
+
+/*
+ * debugfs: "stats" dumps the counters, writing anything to "reset" zeroes
+ * them. Counting is a few increments under the cache lock per transfer
+ * and property read, so the counters are always on.
+ */
+static int max17048_stats_show(struct seq_file *s, void *unused) {
+  struct max17048 *drv = s->private;
+  struct max17048_stats *st = &drv->stats;
+  int i;
+
+  spin_lock_irq(&drv->cache_lock);
+  seq_printf(s, "xfers: %llu\nbytes: %llu\n", st->xfers, st->bytes);
+  seq_printf(s, "uevents: %llu\nsuppressed: %llu\nwakeups: %llu\n",
+             st->uevents, st->suppressed, st->wakeups);
+  seq_printf(s, "absorbed_reads: %llu\n", drv->absorbed_reads);
+
+  seq_puts(s, "\nreg_reads:\n");
+  for (i = 0; i < MAX17048_REG_SLOTS; i++)
+    if (st->reg_reads[i])
+      seq_printf(s, "  0x%02x: %llu\n", i * 2, st->reg_reads[i]);
+
+  seq_puts(s, "\nlatency_us:\n");
+  for (i = 0; i < MAX17048_LAT_BUCKETS - 1; i++)
+    seq_printf(s, "  %6u-%-6u: %llu\n", i ? 1U << i : 0, (2U << i) - 1,
+               st->latency[i]);
+  seq_printf(s, "  %6u+      : %llu\n", 1U << i, st->latency[i]);
+
+  seq_puts(s, "\nproperties: hit miss\n");
+  for (i = 0; st->prop_hit && i < ARRAY_SIZE(max17048_battery_props); i++)
+    seq_printf(s, "  %d: %llu %llu\n", max17048_battery_props[i],
+               st->prop_hit[i], st->prop_miss[i]);
+  spin_unlock_irq(&drv->cache_lock);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(max17048_stats);
+
+static ssize_t max17048_reset_write(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos) {
+  struct max17048 *drv = file->private_data;
+  struct max17048_stats *st = &drv->stats;
+  size_t nprops = ARRAY_SIZE(max17048_battery_props);
+
+  spin_lock_irq(&drv->cache_lock);
+  st->xfers = 0;
+  st->bytes = 0;
+  memset(st->reg_reads, 0, sizeof(st->reg_reads));
+  memset(st->latency, 0, sizeof(st->latency));
+  st->uevents = 0;
+  st->suppressed = 0;
+  st->wakeups = 0;
+  if (st->prop_hit) {
+    memset(st->prop_hit, 0, nprops * sizeof(*st->prop_hit));
+    memset(st->prop_miss, 0, nprops * sizeof(*st->prop_miss));
+  }
+  drv->absorbed_reads = 0;
+  spin_unlock_irq(&drv->cache_lock);
+  return count;
+}
+
+static const struct file_operations max17048_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = max17048_reset_write,
+    .llseek = noop_llseek,
+};
+
+/**
+ * max17048_debugfs_init - Create the per-instance debugfs directory
+ * @drv: Driver data
+ *
+ * Failures are not fatal; debugfs calls accept the error pointer.
+ */
+static void max17048_debugfs_init(struct max17048 *drv) {
+  struct device *dev = drv->dev;
+  size_t nprops = ARRAY_SIZE(max17048_battery_props);
+  char name[32];
+
+  drv->stats.prop_hit = devm_kcalloc(dev, 2 * nprops, sizeof(u64), GFP_KERNEL);
+  if (drv->stats.prop_hit)
+    drv->stats.prop_miss = drv->stats.prop_hit + nprops;
+
+  snprintf(name, sizeof(name), "max17048-%s", dev_name(dev));
+  drv->debugfs = debugfs_create_dir(name, NULL);
+  debugfs_create_file("stats", 0444, drv->debugfs, drv, &max17048_stats_fops);
+  debugfs_create_file("reset", 0200, drv->debugfs, drv,
+                      &max17048_reset_fops);
+  max17048_faults_init(drv);
+}
+
+/**
+ * max17048_init_retry - Run max17048_init_work() again after a backoff
+ * @drv: Driver data
+ */
+static void max17048_init_retry(struct max17048 *drv) {
+  drv->init_retry_ms = drv->init_retry_ms
+                           ? min(drv->init_retry_ms * 2,
+                                 (unsigned int)MAX17048_INIT_RETRY_MAX_MS)
+                           : MAX17048_INIT_RETRY_MS;
+  schedule_delayed_work(&drv->init_work, msecs_to_jiffies(drv->init_retry_ms));
+}
+
+/**
+ * max17048_init_work - Deferred first read and power supply registration
+ * @work: Work item
+ *
+ * Keeps all bus traffic out of probe. The supplies are only registered
+ * once a burst read has succeeded, so their first uevent and property
+ * reads see a live gauge; until then the read is retried with backoff.
+ * A failed registration is retried the same way, the interrupts are only
+ * requested once both supplies exist.
+ */
+static void max17048_init_work(struct work_struct *work) {
+  struct max17048 *drv = container_of(work, struct max17048, init_work.work);
+  struct device *dev = drv->dev;
+  struct power_supply_config psycfg = {};
+  struct max17048_sample sample;
+  int ret;
+
+  /* The failed attempts may have taken the gauge offline */
+  ret = max17048_offline(drv) ? max17048_probe_bus(drv) : 0;
+  if (!ret)
+    ret = max17048_take_sample(drv, &sample);
+  if (ret) {
+    max17048_init_retry(drv);
+    dev_dbg(dev, "First read failed (%d), retry in %u ms\n", ret,
+            drv->init_retry_ms);
+    return;
+  }
+  max17048_record_sample(drv, &sample);
+
+  /* Register Battery */
+  psycfg.drv_data = drv;
+  psycfg.of_node = dev->of_node;
+  psycfg.attr_grp = max17048_battery_groups;
+
+  drv->battery = power_supply_register(dev, drv->battery_desc, &psycfg);
+  if (IS_ERR(drv->battery)) {
+    ret = PTR_ERR(drv->battery);
+    drv->battery = NULL;
+    max17048_init_retry(drv);
+    dev_err(dev, "Failed to register battery (%d), retry in %u ms\n", ret,
+            drv->init_retry_ms);
+    return;
+  }
+
+  /* Register AC Adapter */
+  psycfg.attr_grp = NULL;
+  drv->ac_adapter = power_supply_register(dev, drv->ac_desc, &psycfg);
+  if (IS_ERR(drv->ac_adapter)) {
+    ret = PTR_ERR(drv->ac_adapter);
+    drv->ac_adapter = NULL;
+    power_supply_unregister(drv->battery);
+    drv->battery = NULL;
+    max17048_init_retry(drv);
+    dev_err(dev, "Failed to register AC adapter (%d), retry in %u ms\n", ret,
+            drv->init_retry_ms);
+    return;
+  }
+
+  if (drv->irq) {
+    ret = request_threaded_irq(drv->irq, NULL, max17048_irq_handler,
+                               IRQF_TRIGGER_LOW | IRQF_ONESHOT,
+                               dev_name(dev), drv);
+    if (ret)
+      dev_err(dev, "Failed to request IRQ %d: %d\n", drv->irq, ret);
+    drv->irq_requested = !ret;
+  }
+
+  /* Without an interrupt the GPIO is still sampled by the poll work */
+  if (drv->ac_gpio) {
+    drv->ac_irq = gpiod_to_irq(drv->ac_gpio);
+    ret = drv->ac_irq < 0
+              ? drv->ac_irq
+              : request_threaded_irq(drv->ac_irq, NULL,
+                                     max17048_ac_irq_handler,
+                                     IRQF_TRIGGER_RISING |
+                                         IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+                                     dev_name(dev), drv);
+    if (ret)
+      dev_warn(dev, "No charger-detect interrupt: %d\n", ret);
+    drv->ac_irq_requested = !ret;
+  }
+
+  spin_lock_irq(&drv->cache_lock);
+  drv->polling = true;
+  spin_unlock_irq(&drv->cache_lock);
+  max17048_reschedule(drv, "start", max17048_poll_delay(drv));
+}
+
+/**
+ * max17048_drain_snapshot - Read SOC and VCELL around a suspend
+ * @drv: Driver data
+ * @soc: State of charge in 1/256 %
+ * @uv:  Cell voltage in uV
+ *
+ * One fresh burst, bypassing the rate limit: the cached values may be
+ * older than the suspend itself.
+ */
+static int max17048_drain_snapshot(struct max17048 *drv, int *soc, int *uv) {
+  u16 regs[2];
+  int ret;
+
+  ret = max17048_xfer_read(drv, MAX17048_VCELL_REG, regs, 2);
+  max17048_bus_done(drv, ret);
+  if (ret)
+    return ret;
+  max17048_cache_store(drv, MAX17048_VCELL_REG, regs, 2);
+
+  *uv = drv->variant->vcell_to_uv(regs[0]);
+  *soc = min_t(u32, regs[1], MAX17048_SOC_FULL_FINE);
+  return 0;
+}
+
+static int max17048_suspend(struct device *dev) {
+  struct max17048 *drv = dev_get_drvdata(dev);
+  struct max17048_drain *d = &drv->drain;
+  int soc, uv;
+  bool valid;
+
+  cancel_delayed_work_sync(&drv->work);
+
+  valid = !max17048_offline(drv) && !max17048_drain_snapshot(drv, &soc, &uv);
+  mutex_lock(&drv->lock);
+  d->entry_valid = valid;
+  if (valid) {
+    d->entry_stamp = ktime_get_boottime();
+    d->entry_soc = soc;
+    d->entry_uv = uv;
+  }
+  mutex_unlock(&drv->lock);
+  return 0;
+}
+
+static int max17048_resume(struct device *dev) {
+  struct max17048 *drv = dev_get_drvdata(dev);
+  struct max17048_drain *d = &drv->drain;
+  s64 dt_ms;
+  u64 rate;
+  int soc, uv;
+
+  mutex_lock(&drv->lock);
+  dt_ms = ktime_ms_delta(ktime_get_boottime(), d->entry_stamp);
+  if (d->entry_valid && dt_ms >= MAX17048_DRAIN_MIN_MS &&
+      !max17048_drain_snapshot(drv, &soc, &uv) && soc <= d->entry_soc) {
+    /* 1/256 % over ms -> 1/1000 % per hour */
+    rate = div64_u64((u64)(d->entry_soc - soc) * 1000 * 3600000,
+                     (u64)dt_ms * MAX17048_SOC_LSB_INV);
+    d->last_rate = (u32)min_t(u64, rate, U32_MAX);
+    d->last_uv = d->entry_uv - uv;
+    d->avg_rate = d->count ? (d->avg_rate * 3 + d->last_rate) / 4
+                           : d->last_rate;
+    d->count++;
+    d->hist[min(d->last_rate ? ilog2(d->last_rate) : 0,
+                MAX17048_DRAIN_BUCKETS - 1)]++;
   }
+  d->entry_valid = false;
+  mutex_unlock(&drv->lock);
+
+  /* Refresh right away, the readings are as old as the suspend */
+  spin_lock_irq(&drv->cache_lock);
+  if (drv->polling)
+    mod_delayed_work(system_wq, &drv->work, 0);
+  spin_unlock_irq(&drv->cache_lock);
   return 0;
 }
 
-static enum power_supply_property max17048_ac_props[] = {
-    POWER_SUPPLY_PROP_ONLINE,
+static DEFINE_SIMPLE_DEV_PM_OPS(max17048_pm_ops, max17048_suspend,
+                                max17048_resume);
+
+static const struct max17048_variant max17043_variant = {
+    .model = "MAX17043",
+    .cells = 1,
+    .vcell_to_uv = max17048_vcell_to_uv,
+    .take_sample = max17043_basic_sample,
+    .get_crate = max17043_no_crate,
+    .ack_alert = max17043_ack_config,
+    .props = max17043_battery_props,
+    .num_props = ARRAY_SIZE(max17043_battery_props),
 };
 
-static const struct power_supply_desc max17048_ac_desc = {
-    .name = "max17048-mains",
-    .type = POWER_SUPPLY_TYPE_MAINS,
-    .get_property = max17048_ac_get_property,
-    .properties = max17048_ac_props,
-    .num_properties = ARRAY_SIZE(max17048_ac_props),
+static const struct max17048_variant max17044_variant = {
+    .model = "MAX17044",
+    .cells = 2,
+    .vcell_to_uv = max17049_vcell_to_uv,
+    .take_sample = max17043_basic_sample,
+    .get_crate = max17043_no_crate,
+    .ack_alert = max17043_ack_config,
+    .props = max17043_battery_props,
+    .num_props = ARRAY_SIZE(max17043_battery_props),
 };
 
-static void max17048_work(struct work_struct *work) {
-  struct max17048 *drv = container_of(work, struct max17048, work.work);
-  power_supply_changed(drv->battery);
-  power_supply_changed(drv->ac_adapter);
-  schedule_delayed_work(&drv->work, drv->delay);
-}
+static const struct max17048_variant max17048_variant = {
+    .model = "MAX17048",
+    .cells = 1,
+    .vcell_to_uv = max17048_vcell_to_uv,
+    .take_sample = max17048_burst_sample,
+    .has_crate = true,
+    .get_crate = max17048_read_crate,
+    .ack_alert = max17048_ack_status,
+    .props = max17048_battery_props,
+    .num_props = ARRAY_SIZE(max17048_battery_props),
+};
 
-static irqreturn_t max17048_irq_handler(int irq, void *dev_id) {
-  struct max17048 *drv = dev_id;
-  int ret;
-  unsigned int status;
+static const struct max17048_variant max17049_variant = {
+    .model = "MAX17049",
+    .cells = 2,
+    .vcell_to_uv = max17049_vcell_to_uv,
+    .take_sample = max17048_burst_sample,
+    .has_crate = true,
+    .get_crate = max17048_read_crate,
+    .ack_alert = max17048_ack_status,
+    .props = max17048_battery_props,
+    .num_props = ARRAY_SIZE(max17048_battery_props),
+};
 
-  /* Read Status to clear ALRT pin */
-  ret = regmap_read(drv->regmap, MAX17048_STATUS_REG, &status);
+static DEFINE_IDA(max17048_ida);
+/* Gauges described by the device tree or simulated, counted at load */
+static unsigned int max17048_nr_gauges;
 
-  power_supply_changed(drv->battery);
-  power_supply_changed(drv->ac_adapter);
-  return IRQ_HANDLED;
+static void max17048_release_id(void *data) {
+  struct max17048 *drv = data;
+
+  ida_free(&max17048_ida, drv->id);
 }
 
-static int max17048_probe(struct i2c_client *client) {
-  struct device *dev = &client->dev;
-  struct max17048 *drv;
-  struct power_supply_config psycfg = {};
+/**
+ * max17048_setup_names - Give the instance its own power supply names
+ * @drv: Driver data
+ *
+ * Names come from the "power-supply-name" or "label" property. Without
+ * one, a lone gauge keeps "battery" and "max17048-mains" so existing
+ * userspace is unaffected. When more than one gauge was present at load,
+ * every unlabeled instance is named after its device instead, e.g.
+ * "max17048-1-0036", so names do not depend on which probe finished
+ * first. Instances bound later without a device tree node (e.g. through
+ * new_device) fall back to their device name once "battery" is taken.
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int max17048_setup_names(struct max17048 *drv) {
+  struct device *dev = drv->dev;
+  const char *name = NULL;
   int ret;
 
-  if (!i2c_check_functionality(client->adapter, I2C_FUNC_SMBUS_BYTE))
-    return -EIO;
+  ret = ida_alloc(&max17048_ida, GFP_KERNEL);
+  if (ret < 0)
+    return ret;
+  drv->id = ret;
+  ret = devm_add_action_or_reset(dev, max17048_release_id, drv);
+  if (ret)
+    return ret;
 
-  drv = devm_kzalloc(dev, sizeof(struct max17048), GFP_KERNEL);
-  if (!drv)
+  drv->battery_desc = devm_kmemdup(dev, &max17048_battery_desc,
+                                   sizeof(max17048_battery_desc), GFP_KERNEL);
+  drv->ac_desc = devm_kmemdup(dev, &max17048_ac_desc,
+                              sizeof(max17048_ac_desc), GFP_KERNEL);
+  if (!drv->battery_desc || !drv->ac_desc)
     return -ENOMEM;
+  drv->battery_desc->properties = drv->variant->props;
+  drv->battery_desc->num_properties = drv->variant->num_props;
 
-  drv->client = client;
-  drv->regmap = devm_regmap_init_i2c(client, &max17048_regmap_cfg);
-  if (IS_ERR(drv->regmap))
-    return PTR_ERR(drv->regmap);
+  if (device_property_read_string(dev, "power-supply-name", &name))
+    device_property_read_string(dev, "label", &name);
+  if (!name && (max17048_nr_gauges > 1 || drv->id)) {
+    name = devm_kasprintf(dev, GFP_KERNEL, "max17048-%s", dev_name(dev));
+    if (!name)
+      return -ENOMEM;
+  }
+
+  if (name) {
+    drv->battery_desc->name = name;
+    drv->ac_desc->name = devm_kasprintf(dev, GFP_KERNEL, "%s-mains", name);
+    if (!drv->ac_desc->name)
+      return -ENOMEM;
+  }
+
+  dev_info(dev, "Supplies %s and %s\n", drv->battery_desc->name,
+           drv->ac_desc->name);
+  return 0;
+}
+
+/**
+ * max17048_read_config - Apply the device properties and defaults
+ * @drv: Driver data with @dev and @variant filled in
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int max17048_read_config(struct max17048 *drv) {
+  struct device *dev = drv->dev;
+  u32 val;
+  int ret;
 
   /* Read properties */
   ret = device_property_read_u32(dev, "charge-full-design-microamp-hours",
@@ -493,65 +3483,681 @@ static int max17048_probe(struct i2c_client *client) {
   dev_info(dev, "MAX17048: Design: %u uAh, %u uWh\n",
            drv->charge_full_design_uah, drv->energy_full_design_uwh);
 
-  /* Register Battery */
-  psycfg.drv_data = drv;
-  psycfg.of_node = dev->of_node;
+  drv->tun.crate_noise_thr = MAX17048_CRATE_NOISE_THR;
+  drv->tun.full_soc_thr = MAX17048_FULL_SOC_THR;
+  drv->tun.tte_tuning_factor = MAX17048_TTE_TUNING_FACTOR;
+  /* Heartbeat poll every 5 minutes if IRQ is present */
+  drv->tun.poll_irq_ms = MAX17048_POLL_IRQ_MS;
+  /* Poll every 30 seconds if no IRQ */
+  drv->tun.poll_ms = MAX17048_POLL_MS;
+  drv->tun.soc_hyst = MAX17048_DEFAULT_SOC_HYST;
+  drv->tun.ac_debounce = MAX17048_AC_DEBOUNCE;
+  drv->tun.term_crate = MAX17048_TERM_CRATE;
+  drv->tun.term_samples = MAX17048_TERM_SAMPLES;
 
-  drv->battery =
-      devm_power_supply_register(dev, &max17048_battery_desc, &psycfg);
-  if (IS_ERR(drv->battery)) {
-    dev_err(dev, "Failed to register battery\n");
-    return PTR_ERR(drv->battery);
+  /* Per-SKU tuning, settable through the overlay parameters */
+  if (!device_property_read_u32(dev, "poll-interval-ms", &val) && val) {
+    drv->tun.poll_ms = clamp_t(u32, val, MAX17048_MIN_POLL_MS,
+                               MAX17048_MAX_POLL_MS);
+    drv->tun.poll_irq_ms = drv->tun.poll_ms;
   }
 
-  /* Register AC Adapter */
-  drv->ac_adapter = devm_power_supply_register(dev, &max17048_ac_desc, &psycfg);
-  if (IS_ERR(drv->ac_adapter)) {
-    dev_err(dev, "Failed to register AC adapter\n");
-    return PTR_ERR(drv->ac_adapter);
+  if (!device_property_read_u32(dev, "soc-hysteresis-percent", &val))
+    drv->tun.soc_hyst = min_t(u32, val, MAX17048_MAX_SOC_HYST);
+
+  /* Smoothed display SOC is opt-in */
+  if (!device_property_read_u32(dev, "display-soc-rate", &val))
+    drv->tun.display_rate = min_t(u32, val, MAX17048_MAX_DISPLAY_RATE);
+  drv->display_soc = -1;
+
+  /* A charger-detect line makes AC presence exact and immediate */
+  drv->ac_gpio = devm_gpiod_get_optional(dev, "charger-detect", GPIOD_IN);
+  if (IS_ERR(drv->ac_gpio))
+    return dev_err_probe(dev, PTR_ERR(drv->ac_gpio),
+                         "Failed to get charger-detect GPIO\n");
+
+  /* Charge voltage the termination plateau is measured against */
+  if (device_property_read_u32(dev, "voltage-max-design-microvolt",
+                               &drv->vmax_uv) ||
+      drv->vmax_uv < MAX17048_TERM_MARGIN_UV * drv->variant->cells)
+    drv->vmax_uv = MAX17048_DEFAULT_VMAX_UV * drv->variant->cells;
+
+  /* The cutoff applies to the pack, the limits to each cell in it */
+  drv->cutoff_uv = MAX17048_DEFAULT_CUTOFF_UV * drv->variant->cells;
+  if (!device_property_read_u32(dev, "cutoff-millivolt", &val))
+    drv->cutoff_uv = clamp_t(u32, val,
+                             MAX17048_MIN_CUTOFF_MV * drv->variant->cells,
+                             MAX17048_MAX_CUTOFF_MV * drv->variant->cells) *
+                     1000;
+
+  /* Capacity starts from design until a measured value is restored */
+  mutex_init(&drv->lock);
+  spin_lock_init(&drv->cache_lock);
+  drv->learn.charge_full_uah = drv->charge_full_design_uah;
+  drv->learn.last_soc = -1;
+  return 0;
+}
+
+/**
+ * max17048_setup - Bus independent part of probe
+ * @drv: Driver data with @dev, @regmap, @client, @irq and @variant
+ *       filled in
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int max17048_setup(struct max17048 *drv) {
+  struct device *dev = drv->dev;
+  int ret;
+
+  max17048_setup_bus(drv);
+
+  ret = max17048_read_config(drv);
+  if (ret)
+    return ret;
+
+  /* Capacity and cycle count persist in nvmem if wired */
+  drv->nvmem = devm_nvmem_cell_get(dev, "learned-params");
+  if (IS_ERR(drv->nvmem)) {
+    ret = PTR_ERR(drv->nvmem);
+    drv->nvmem = NULL;
+    if (ret == -EPROBE_DEFER)
+      return ret;
   }
+  max17048_learn_restore(drv);
+
+  ret = max17048_setup_names(drv);
+  if (ret)
+    return ret;
 
-  i2c_set_clientdata(client, drv);
+  dev_set_drvdata(dev, drv);
 
   INIT_DELAYED_WORK(&drv->work, max17048_work);
+  INIT_DELAYED_WORK(&drv->init_work, max17048_init_work);
 
-  if (client->irq) {
-    ret = devm_request_threaded_irq(
-        dev, client->irq, NULL, max17048_irq_handler,
-        IRQF_TRIGGER_LOW | IRQF_ONESHOT, "max17048-battery", drv);
-    if (ret) {
-      dev_err(dev, "Failed to request IRQ %d: %d\n", client->irq, ret);
-      return ret;
+  /* No touch activity seen yet */
+  drv->last_touch = jiffies - msecs_to_jiffies(touch_quiet_ms) - 1;
+  drv->touch_handler.name = "max17048-touch";
+  drv->touch_handler.event = max17048_touch_event;
+  drv->touch_handler.connect = max17048_touch_connect;
+  drv->touch_handler.disconnect = max17048_touch_disconnect;
+  drv->touch_handler.id_table = max17048_touch_ids;
+  drv->touch_handler.private = drv;
+  ret = input_register_handler(&drv->touch_handler);
+  if (ret)
+    return ret;
+
+  max17048_debugfs_init(drv);
+
+  /* Bus traffic and registration happen in max17048_init_work() */
+  schedule_delayed_work(&drv->init_work, 0);
+
+  return 0;
+}
+
+/**
+ * max17048_teardown - Bus independent part of remove
+ * @drv: Driver data
+ */
+static void max17048_teardown(struct max17048 *drv) {
+  debugfs_remove_recursive(drv->debugfs);
+  cancel_delayed_work_sync(&drv->init_work);
+  if (drv->irq_requested)
+    free_irq(drv->irq, drv);
+  if (drv->ac_irq_requested)
+    free_irq(drv->ac_irq, drv);
+
+  spin_lock_irq(&drv->cache_lock);
+  drv->polling = false;
+  spin_unlock_irq(&drv->cache_lock);
+  cancel_delayed_work_sync(&drv->work);
+
+  if (drv->ac_adapter)
+    power_supply_unregister(drv->ac_adapter);
+  if (drv->battery)
+    power_supply_unregister(drv->battery);
+
+  input_unregister_handler(&drv->touch_handler);
+}
+
+static int max17048_probe(struct i2c_client *client) {
+  struct device *dev = &client->dev;
+  struct max17048 *drv;
+
+  if (!i2c_check_functionality(client->adapter, I2C_FUNC_SMBUS_BYTE))
+    return -EIO;
+
+  drv = devm_kzalloc(dev, sizeof(struct max17048), GFP_KERNEL);
+  if (!drv)
+    return -ENOMEM;
+
+  drv->client = client;
+  drv->dev = dev;
+  drv->irq = client->irq;
+  drv->variant = i2c_get_match_data(client);
+  if (!drv->variant)
+    return -ENODEV;
+  drv->regmap = devm_regmap_init_i2c(client, &max17048_regmap_cfg);
+  if (IS_ERR(drv->regmap))
+    return PTR_ERR(drv->regmap);
+
+  return max17048_setup(drv);
+}
+
+static void max17048_remove(struct i2c_client *client) {
+  max17048_teardown(i2c_get_clientdata(client));
+}
+
+/*
+ * Simulated gauge. With simulate=1 a "max17048-sim" platform device is
+ * bound through a regmap answered by a single-cell LiPo model instead of
+ * the bus, so the refresh, decode and uevent paths run end to end on any
+ * machine. Model time runs sim_speed times faster than real time.
+ *
+ * With sim_replay the model is replaced by a recorded trace. Every poll
+ * refresh decodes exactly one record and the next poll is due after the
+ * recorded gap divided by sim_speed, so runs are identical at any speed.
+ */
+static bool simulate;
+module_param(simulate, bool, 0444);
+MODULE_PARM_DESC(simulate, "Instantiate a simulated gauge");
+
+static unsigned int sim_capacity_mah = 5000;
+module_param(sim_capacity_mah, uint, 0444);
+MODULE_PARM_DESC(sim_capacity_mah, "Simulated cell capacity in mAh");
+
+static unsigned int sim_soc = 80;
+module_param(sim_soc, uint, 0444);
+MODULE_PARM_DESC(sim_soc, "Simulated initial state of charge in %");
+
+static int sim_load_ma = 800;
+module_param(sim_load_ma, int, 0644);
+MODULE_PARM_DESC(sim_load_ma, "Simulated base load in mA, negative charges");
+
+static int sim_burst_ma;
+module_param(sim_burst_ma, int, 0644);
+MODULE_PARM_DESC(sim_burst_ma, "Extra load during every other half period");
+
+static unsigned int sim_burst_period_s = 60;
+module_param(sim_burst_period_s, uint, 0644);
+MODULE_PARM_DESC(sim_burst_period_s, "Period of the load bursts in seconds");
+
+static unsigned int sim_speed = 1;
+module_param(sim_speed, uint, 0644);
+MODULE_PARM_DESC(sim_speed, "Simulated time acceleration factor");
+
+static unsigned int sim_rint_mohm = 150;
+module_param(sim_rint_mohm, uint, 0644);
+MODULE_PARM_DESC(sim_rint_mohm, "Simulated internal resistance in mOhm");
+
+static char *sim_replay;
+module_param(sim_replay, charp, 0444);
+MODULE_PARM_DESC(sim_replay, "Firmware file with a register trace to replay");
+
+/**
+ * struct max17048_replay_rec - One line of a recorded register trace
+ * @ms:     Time since the first record
+ * @vcell:  Raw VCELL
+ * @soc:    Raw SOC
+ * @crate:  Raw CRATE
+ * @status: Raw STATUS
+ */
+struct max17048_replay_rec {
+  u32 ms;
+  u16 vcell;
+  u16 soc;
+  u16 crate;
+  u16 status;
+};
+
+/**
+ * struct max17048_sim - State of the simulated cell
+ * @last:       Boot time the model was last advanced
+ * @model_ms:   Model time since the simulation started
+ * @charge_nah: Remaining charge in nAh
+ * @cap_nah:    Full charge in nAh
+ * @load_ua:    Present load, positive when discharging
+ * @regs:       Writable registers, indexed by register / 2
+ * @rec:        Replayed trace, replaces the model when set
+ * @nrec:       Number of records in @rec
+ * @pos:        Record in effect at @model_ms
+ * @status_ack: STATUS bits of the current record cleared by the driver
+ * @step:       The poll work asked for the next record
+ * @dev:        Simulated device, for log messages
+ *
+ * Serialized by the regmap lock, except for @step.
+ */
+struct max17048_sim {
+  ktime_t last;
+  s64 model_ms;
+  s64 charge_nah;
+  s64 cap_nah;
+  int load_ua;
+  u16 regs[MAX17048_REG_SLOTS];
+  struct max17048_replay_rec *rec;
+  unsigned int nrec;
+  unsigned int pos;
+  u16 status_ack;
+  atomic_t step;
+  struct device *dev;
+};
+
+static ktime_t max17048_sim_clock(struct max17048_sim *sim) {
+  return ms_to_ktime(READ_ONCE(sim->model_ms));
+}
+
+/**
+ * max17048_replay_step - Ask for the next replayed record
+ * @sim: Simulation state
+ *
+ * The record is switched on the next register read, under the regmap lock.
+ * Returns false if no replay is running or it has finished.
+ */
+static bool max17048_replay_step(struct max17048_sim *sim) {
+  if (!sim->rec || READ_ONCE(sim->pos) + 1 >= sim->nrec)
+    return false;
+  atomic_set(&sim->step, 1);
+  return true;
+}
+
+/**
+ * max17048_replay_delay - Real time until the next record is due
+ * @sim: Simulation state
+ *
+ * Returns the recorded gap scaled down by sim_speed in jiffies, or
+ * ULONG_MAX if no replay is running or it has finished.
+ */
+static unsigned long max17048_replay_delay(struct max17048_sim *sim) {
+  unsigned int pos = READ_ONCE(sim->pos);
+
+  if (!sim->rec || pos + 1 >= sim->nrec)
+    return ULONG_MAX;
+  return msecs_to_jiffies((sim->rec[pos + 1].ms - sim->rec[pos].ms) /
+                          max(READ_ONCE(sim_speed), 1U));
+}
+
+/**
+ * max17048_sim_advance - Run the cell model up to now
+ * @sim: Simulation state
+ *
+ * A replay instead switches to the next record if one was asked for.
+ */
+static void max17048_sim_advance(struct max17048_sim *sim) {
+  unsigned int half = READ_ONCE(sim_burst_period_s) * 500;
+  ktime_t now = ktime_get_boottime();
+  s64 dt;
+  int load;
+
+  /* A replay only moves when the poll work steps it */
+  if (sim->rec) {
+    if (atomic_xchg(&sim->step, 0) && sim->pos + 1 < sim->nrec) {
+      WRITE_ONCE(sim->pos, sim->pos + 1);
+      WRITE_ONCE(sim->model_ms, sim->rec[sim->pos].ms);
+      sim->status_ack = 0;
+      if (sim->pos + 1 == sim->nrec)
+        dev_info(sim->dev, "Replay finished after %u records\n", sim->nrec);
     }
-    /* Heartbeat poll every 5 minutes if IRQ is present */
-    drv->delay = msecs_to_jiffies(300000);
-  } else {
-    /* Poll every 30 seconds if no IRQ */
-    drv->delay = msecs_to_jiffies(30000);
+    return;
+  }
+
+  dt = ktime_ms_delta(now, sim->last) * max(READ_ONCE(sim_speed), 1U);
+  sim->last = now;
+  WRITE_ONCE(sim->model_ms, sim->model_ms + dt);
+
+  load = READ_ONCE(sim_load_ma) * 1000;
+  if (half && div64_u64(sim->model_ms, half) & 1)
+    load += READ_ONCE(sim_burst_ma) * 1000;
+
+  /* nAh = uA * ms / 3600 */
+  sim->charge_nah -= div_s64((s64)load * dt, 3600);
+  sim->charge_nah = clamp(sim->charge_nah, 0LL, sim->cap_nah);
+  if ((load > 0 && !sim->charge_nah) ||
+      (load < 0 && sim->charge_nah == sim->cap_nah))
+    load = 0;
+  sim->load_ua = load;
+}
+
+/**
+ * max17048_replay_read - Answer a register read from the replayed trace
+ * @sim: Simulation state
+ * @reg: Register address
+ * @val: Register value
+ *
+ * Measurement registers come from the record in effect; the others behave
+ * like the model's, so configuration writes still round-trip.
+ */
+static int max17048_replay_read(struct max17048_sim *sim, unsigned int reg,
+                                unsigned int *val) {
+  const struct max17048_replay_rec *r = &sim->rec[sim->pos];
+
+  switch (reg) {
+  case MAX17048_VCELL_REG:
+    *val = r->vcell;
+    return 0;
+  case MAX17048_SOC_REG:
+    *val = r->soc;
+    return 0;
+  case MAX17048_CRATE_REG:
+    *val = r->crate;
+    return 0;
+  case MAX17048_STATUS_REG:
+    *val = r->status & ~sim->status_ack;
+    return 0;
+  case MAX17048_VERSION_REG:
+    *val = 0x0012;
+    return 0;
+  case MAX17048_MODE_REG:
+  case MAX17048_CONFIG_REG:
+  case MAX17048_VALRT_REG:
+  case MAX17048_VRESET_REG:
+    *val = sim->regs[reg / 2];
+    return 0;
+  default:
+    /* Reserved and locked model registers, see max17048_sim_reg_read() */
+    *val = 0;
+    return 0;
   }
+}
 
-  schedule_delayed_work(&drv->work, drv->delay);
+static int max17048_sim_reg_read(void *context, unsigned int reg,
+                                 unsigned int *val) {
+  struct max17048_sim *sim = context;
+  s64 cap_uah = div_s64(sim->cap_nah, 1000);
+  int soc, uv;
 
+  max17048_sim_advance(sim);
+  if (sim->rec)
+    return max17048_replay_read(sim, reg, val);
+  soc = (int)div64_s64(sim->charge_nah * MAX17048_SOC_FULL_FINE, sim->cap_nah);
+
+  switch (reg) {
+  case MAX17048_VCELL_REG:
+    uv = max17048_ocv_at(soc) -
+         (int)div_s64((s64)sim->load_ua * READ_ONCE(sim_rint_mohm), 1000);
+    *val = clamp(uv, 0, 0xFFFF * MAX17048_VCELL_LSB_NUM /
+                            MAX17048_VCELL_LSB_DEN) *
+           MAX17048_VCELL_LSB_DEN / MAX17048_VCELL_LSB_NUM;
+    break;
+  case MAX17048_SOC_REG:
+    *val = soc;
+    break;
+  case MAX17048_VERSION_REG:
+    *val = 0x0012;
+    break;
+  case MAX17048_CRATE_REG:
+    /* Discharge reads negative, see max17048_crate_scale() */
+    *val = (u16)clamp_t(s64,
+                        div64_s64(-(s64)sim->load_ua * MAX17048_CRATE_LSB_DEN,
+                                  cap_uah * MAX17048_CRATE_LSB_NUM),
+                        S16_MIN, S16_MAX);
+    break;
+  case MAX17048_MODE_REG:
+  case MAX17048_CONFIG_REG:
+  case MAX17048_VALRT_REG:
+  case MAX17048_VRESET_REG:
+  case MAX17048_STATUS_REG:
+    *val = sim->regs[reg / 2];
+    break;
+  default:
+    /*
+     * Reserved and locked model registers read as 0. A bus-less regmap
+     * reads a burst register by register, so failing here would fail
+     * every wide sample.
+     */
+    *val = 0;
+    break;
+  }
   return 0;
 }
 
-static void max17048_remove(struct i2c_client *client) {
-  struct max17048 *drv = i2c_get_clientdata(client);
-  cancel_delayed_work_sync(&drv->work);
+static int max17048_sim_reg_write(void *context, unsigned int reg,
+                                  unsigned int val) {
+  struct max17048_sim *sim = context;
+
+  switch (reg) {
+  case MAX17048_MODE_REG:
+    /* QuickStart is self-clearing and restarts nothing in the model */
+    sim->regs[reg / 2] = val & ~MAX17048_MODE_QUICK_START;
+    break;
+  case MAX17048_STATUS_REG:
+    /* Alert flags are cleared by writing 0 */
+    if (sim->rec)
+      sim->status_ack |= sim->rec[sim->pos].status & ~val;
+    sim->regs[reg / 2] = val;
+    break;
+  case MAX17048_CONFIG_REG:
+  case MAX17048_VALRT_REG:
+  case MAX17048_VRESET_REG:
+    sim->regs[reg / 2] = val;
+    break;
+  default:
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * max17048_replay_load - Load a recorded register trace
+ * @sim:  Simulation state
+ * @name: Firmware file name
+ *
+ * One record per line, "<ms> <VCELL> <SOC> <CRATE> <STATUS>", with raw
+ * register values in decimal or 0x-prefixed hex. Timestamps must not
+ * decrease and are taken relative to the first record. Empty lines and
+ * lines starting with '#' are skipped.
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int max17048_replay_load(struct max17048_sim *sim, const char *name) {
+  const struct firmware *fw;
+  unsigned int ms, vcell, soc, crate, status, n = 0, lineno = 0;
+  char *text, *cur, *line;
+  u32 first = 0;
+  int ret;
+
+  ret = request_firmware(&fw, name, sim->dev);
+  if (ret)
+    return ret;
+  text = kmemdup_nul(fw->data, fw->size, GFP_KERNEL);
+  release_firmware(fw);
+  if (!text)
+    return -ENOMEM;
+
+  /* Upper bound on the record count */
+  for (cur = text; *cur; cur++)
+    n += *cur == '\n';
+  sim->rec = devm_kcalloc(sim->dev, n + 1, sizeof(*sim->rec), GFP_KERNEL);
+  if (!sim->rec) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  cur = text;
+  while ((line = strsep(&cur, "\n"))) {
+    struct max17048_replay_rec *r = &sim->rec[sim->nrec];
+
+    lineno++;
+    line = skip_spaces(line);
+    if (!*line || *line == '#')
+      continue;
+    if (sscanf(line, "%u %i %i %i %i", &ms, &vcell, &soc, &crate,
+               &status) != 5 ||
+        (sim->nrec &&
+         (ms < first || ms - first < sim->rec[sim->nrec - 1].ms))) {
+      dev_err(sim->dev, "%s:%u: bad record\n", name, lineno);
+      ret = -EINVAL;
+      goto out;
+    }
+    if (!sim->nrec)
+      first = ms;
+    r->ms = ms - first;
+    r->vcell = vcell;
+    r->soc = soc;
+    r->crate = crate;
+    r->status = status;
+    sim->nrec++;
+  }
+
+  if (!sim->nrec)
+    ret = -ENODATA;
+  else
+    dev_info(sim->dev, "Replaying %u records from %s\n", sim->nrec, name);
+out:
+  if (ret)
+    sim->rec = NULL;
+  kfree(text);
+  return ret;
+}
+
+static const struct regmap_config max17048_sim_regmap_cfg = {
+    .reg_bits = 8,
+    .reg_stride = 2,
+    .val_bits = 16,
+    .max_register = MAX17048_STATUS_REG,
+    .reg_read = max17048_sim_reg_read,
+    .reg_write = max17048_sim_reg_write,
+    .cache_type = REGCACHE_NONE,
+};
+
+static int max17048_sim_probe(struct platform_device *pdev) {
+  struct device *dev = &pdev->dev;
+  struct max17048_sim *sim;
+  struct max17048 *drv;
+  int ret;
+
+  sim = devm_kzalloc(dev, sizeof(*sim), GFP_KERNEL);
+  drv = devm_kzalloc(dev, sizeof(*drv), GFP_KERNEL);
+  if (!sim || !drv)
+    return -ENOMEM;
+
+  sim->last = ktime_get_boottime();
+  sim->cap_nah = (s64)sim_capacity_mah * 1000000;
+  sim->charge_nah = div_s64(sim->cap_nah * min(sim_soc, 100U), 100);
+  /* Power-on defaults, with the reset flag raised like a fresh cell */
+  sim->regs[MAX17048_CONFIG_REG / 2] = 0x971C;
+  sim->regs[MAX17048_VALRT_REG / 2] = 0x00FF;
+  sim->regs[MAX17048_VRESET_REG / 2] = 0x9600;
+  sim->regs[MAX17048_STATUS_REG / 2] = MAX17048_STATUS_RI;
+  sim->dev = dev;
+
+  if (sim_replay && *sim_replay) {
+    ret = max17048_replay_load(sim, sim_replay);
+    if (ret)
+      return dev_err_probe(dev, ret, "Failed to load replay %s\n",
+                           sim_replay);
+  }
+
+  drv->dev = dev;
+  drv->sim = sim;
+  drv->variant = &max17048_variant;
+  drv->regmap = devm_regmap_init(dev, NULL, sim, &max17048_sim_regmap_cfg);
+  if (IS_ERR(drv->regmap))
+    return PTR_ERR(drv->regmap);
+
+  return max17048_setup(drv);
+}
+
+static void max17048_sim_remove(struct platform_device *pdev) {
+  max17048_teardown(platform_get_drvdata(pdev));
 }
 
-static struct of_device_id max17048_of_ids[] = {
-    {.compatible = "hackberrypi,max17048-battery"}, {}};
+static struct platform_driver max17048_sim_driver = {
+    .driver = {.name = "max17048-sim",
+               .pm = pm_sleep_ptr(&max17048_pm_ops)},
+    .probe = max17048_sim_probe,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+    .remove = max17048_sim_remove,
+#else
+    .remove_new = max17048_sim_remove,
+#endif
+};
+
+static struct platform_device *max17048_sim_pdev;
+
+static const struct of_device_id max17048_of_ids[] = {
+    {.compatible = "hackberrypi,max17043-battery", .data = &max17043_variant},
+    {.compatible = "hackberrypi,max17044-battery", .data = &max17044_variant},
+    {.compatible = "hackberrypi,max17048-battery", .data = &max17048_variant},
+    {.compatible = "hackberrypi,max17049-battery", .data = &max17049_variant},
+    {}};
 MODULE_DEVICE_TABLE(of, max17048_of_ids);
 
+/* For binding without a device tree node, e.g. on i2c-stub */
+static const struct i2c_device_id max17048_i2c_ids[] = {
+    {"hackberry-max17043", (kernel_ulong_t)&max17043_variant},
+    {"hackberry-max17044", (kernel_ulong_t)&max17044_variant},
+    {"hackberry-max17048", (kernel_ulong_t)&max17048_variant},
+    {"hackberry-max17049", (kernel_ulong_t)&max17049_variant},
+    {}};
+MODULE_DEVICE_TABLE(i2c, max17048_i2c_ids);
+
 static struct i2c_driver max17048_driver = {
-    .driver = {.name = "max17048", .of_match_table = max17048_of_ids},
+    .driver = {.name = "max17048",
+               .of_match_table = max17048_of_ids,
+               .pm = pm_sleep_ptr(&max17048_pm_ops),
+               .probe_type = PROBE_PREFER_ASYNCHRONOUS},
     .probe = max17048_probe,
     .remove = max17048_remove,
+    .id_table = max17048_i2c_ids,
 };
 
-module_i2c_driver(max17048_driver);
+static int __init max17048_init(void) {
+  struct property_entry props[2] = {};
+  struct platform_device_info info = {
+      .name = "max17048-sim",
+      .id = PLATFORM_DEVID_NONE,
+      .properties = props,
+  };
+  struct device_node *np;
+  int ret;
+
+  /* Decide on legacy names before any asynchronous probe can run */
+  for_each_matching_node(np, max17048_of_ids)
+    if (of_device_is_available(np))
+      max17048_nr_gauges++;
+  if (simulate)
+    max17048_nr_gauges++;
+
+  ret = i2c_add_driver(&max17048_driver);
+  if (ret || !simulate)
+    return ret;
+
+  sim_capacity_mah = clamp(sim_capacity_mah, 100U,
+                           (unsigned int)MAX17048_MAX_CAP_UAH / 1000);
+  props[0] = PROPERTY_ENTRY_U32("charge-full-design-microamp-hours",
+                                sim_capacity_mah * 1000);
+
+  ret = platform_driver_register(&max17048_sim_driver);
+  if (ret)
+    goto err_i2c;
+
+  max17048_sim_pdev = platform_device_register_full(&info);
+  if (IS_ERR(max17048_sim_pdev)) {
+    ret = PTR_ERR(max17048_sim_pdev);
+    goto err_sim;
+  }
+  return 0;
+
+err_sim:
+  platform_driver_unregister(&max17048_sim_driver);
+err_i2c:
+  i2c_del_driver(&max17048_driver);
+  return ret;
+}
+module_init(max17048_init);
+
+static void __exit max17048_exit(void) {
+  if (max17048_sim_pdev) {
+    platform_device_unregister(max17048_sim_pdev);
+    platform_driver_unregister(&max17048_sim_driver);
+  }
+  i2c_del_driver(&max17048_driver);
+}
+module_exit(max17048_exit);
 
 MODULE_DESCRIPTION("MAX17048 fuel gauge driver for HackBerryPi CM5");
 MODULE_AUTHOR("CNflysky <cnflysky@qq.com>");
 MODULE_LICENSE("GPL");
+
+#ifdef MAX17048_KUNIT
+#include "hackberrypi-max17048-test.c"
+#endif
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+#
+# End-to-end benchmark for the MAX17048 driver on i2c-stub.
+#
+# Loads i2c-stub with the gauge register map at 0x36, binds the driver to
+# it and measures sysfs property latency, bus transactions per uevent and
+# read throughput under concurrent readers. Results are printed as JSON.
+#
+# Needs root, i2c-tools and debugfs. Run through "make bench".
+
+import argparse
+import glob
+import json
+import multiprocessing
+import os
+import subprocess
+import sys
+import time
+
+ADDR = 0x36
+DEVICE_ID = "hackberry-max17048"
+
+# Raw register values: 3.8 V, 75 %, light discharge, no alerts
+REGS = {
+    0x02: 0xBE00,  # VCELL
+    0x04: 0x4B00,  # SOC
+    0x06: 0x0000,  # MODE
+    0x08: 0x0012,  # VERSION
+    0x0C: 0x971C,  # CONFIG
+    0x14: 0x00FF,  # VALRT
+    0x16: 0xFF9C,  # CRATE
+    0x18: 0x9600,  # VRESET
+    0x1A: 0x0000,  # STATUS
+}
+
+
+def run(*cmd):
+    subprocess.run(cmd, check=True)
+
+
+def write(path, text):
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def read(path):
+    with open(path) as f:
+        return f.read()
+
+
+def stub_bus():
+    for name in glob.glob("/sys/bus/i2c/devices/i2c-*/name"):
+        if read(name).strip() == "SMBus stub driver":
+            return int(os.path.basename(os.path.dirname(name))[4:])
+    sys.exit("i2c-stub adapter not found")
+
+
+def seed(bus):
+    # i2c-stub keeps one word per address. Word reads return it byte
+    # swapped, I2C block reads return the low byte of consecutive
+    # addresses, so store both views of each big-endian register.
+    for reg, val in REGS.items():
+        swapped = ((val & 0xFF) << 8) | (val >> 8)
+        run("i2cset", "-y", str(bus), hex(ADDR), hex(reg), hex(swapped), "w")
+        run("i2cset", "-y", str(bus), hex(ADDR), hex(reg + 1),
+            hex(val & 0xFF), "w")
+
+
+def wait_for(pattern, timeout=10):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        found = glob.glob(pattern)
+        if found:
+            return found
+        time.sleep(0.1)
+    sys.exit("timed out waiting for " + pattern)
+
+
+def xfers(stats):
+    for line in read(stats).splitlines():
+        if line.startswith("xfers:"):
+            return int(line.split()[1])
+    return 0
+
+
+def percentile(samples, pct):
+    samples = sorted(samples)
+    return samples[min(len(samples) - 1, len(samples) * pct // 100)]
+
+
+def properties(supply):
+    props = []
+    for entry in sorted(os.listdir(supply)):
+        path = os.path.join(supply, entry)
+        if entry in ("uevent", "type") or not os.path.isfile(path):
+            continue
+        if not os.stat(path).st_mode & 0o444:
+            continue
+        try:
+            read(path)
+        except OSError:
+            continue
+        props.append(entry)
+    return props
+
+
+def latency(path, iterations):
+    samples = []
+    for _ in range(iterations):
+        start = time.perf_counter_ns()
+        try:
+            read(path)
+        except OSError:
+            pass
+        samples.append(time.perf_counter_ns() - start)
+    return {
+        "p50_us": percentile(samples, 50) / 1000,
+        "p99_us": percentile(samples, 99) / 1000,
+    }
+
+
+def reader(path, seconds, count):
+    deadline = time.monotonic() + seconds
+    reads = 0
+    while time.monotonic() < deadline:
+        try:
+            read(path)
+        except OSError:
+            pass
+        reads += 1
+    with count.get_lock():
+        count.value += reads
+
+
+def throughput(path, readers, seconds):
+    count = multiprocessing.Value("L", 0)
+    procs = [multiprocessing.Process(target=reader,
+                                     args=(path, seconds, count))
+             for _ in range(readers)]
+    for p in procs:
+        p.start()
+    for p in procs:
+        p.join()
+    return count.value / seconds
+
+
+def main():
+    ap = argparse.ArgumentParser(
+        description="Benchmark the MAX17048 driver on i2c-stub")
+    ap.add_argument("--module", default="./hackberrypi-max17048.ko")
+    ap.add_argument("--module-args", default="",
+                    help="parameters for insmod, e.g. min_read_interval_ms=0")
+    ap.add_argument("--iterations", type=int, default=1000)
+    ap.add_argument("--uevents", type=int, default=100)
+    ap.add_argument("--readers", default="1,2,4,8")
+    ap.add_argument("--seconds", type=float, default=5)
+    ap.add_argument("--output", help="write JSON here instead of stdout")
+    args = ap.parse_args()
+
+    run("modprobe", "i2c-dev")
+    run("modprobe", "i2c-stub", "chip_addr=" + hex(ADDR))
+    bus = stub_bus()
+    dev = "%d-%04x" % (bus, ADDR)
+    seed(bus)
+    run("insmod", args.module, *args.module_args.split())
+    try:
+        write("/sys/bus/i2c/devices/i2c-%d/new_device" % bus,
+              "%s 0x%02x" % (DEVICE_ID, ADDR))
+        supply = wait_for("/sys/bus/i2c/devices/%s/power_supply/*" % dev)
+        supply = [s for s in supply if read(s + "/type").strip() == "Battery"]
+        supply = supply[0]
+        stats = "/sys/kernel/debug/max17048-%s/stats" % dev
+        reset = "/sys/kernel/debug/max17048-%s/reset" % dev
+
+        result = {
+            "module_args": args.module_args,
+            "supply": os.path.basename(supply),
+            "properties": {},
+            "throughput": {},
+        }
+
+        for prop in properties(supply):
+            path = os.path.join(supply, prop)
+            write(reset, "1")
+            result["properties"][prop] = latency(path, args.iterations)
+            result["properties"][prop]["xfers_per_read"] = (
+                xfers(stats) / args.iterations)
+
+        write(reset, "1")
+        uevent = latency(os.path.join(supply, "uevent"), args.uevents)
+        uevent["xfers_per_uevent"] = xfers(stats) / args.uevents
+        result["uevent"] = uevent
+
+        capacity = os.path.join(supply, "capacity")
+        for n in (int(r) for r in args.readers.split(",")):
+            result["throughput"][str(n)] = {
+                "reads_per_s": throughput(capacity, n, args.seconds)}
+    finally:
+        write("/sys/bus/i2c/devices/i2c-%d/delete_device" % bus,
+              "0x%02x" % ADDR)
+        run("rmmod", os.path.basename(args.module)[:-3].replace("-", "_"))
+        run("rmmod", "i2c-stub")
+
+    text = json.dumps(result, indent=2, sort_keys=True)
+    if args.output:
+        write(args.output, text + "\n")
+    else:
+        print(text)
+
+
+if __name__ == "__main__":
+    main()
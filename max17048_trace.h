@@ -0,0 +1,128 @@
+/*
+ * Trace events for the HackberryPi CM5 MAX17048 fuel gauge driver.
+ *
+ * Enable with e.g.
+ *   echo 1 > /sys/kernel/tracing/events/max17048/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM max17048
+
+#if !defined(_MAX17048_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MAX17048_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#ifndef max17048_assign_str
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define max17048_assign_str(dst, src) __assign_str(dst)
+#else
+#define max17048_assign_str(dst, src) __assign_str(dst, src)
+#endif
+#endif
+
+#define max17048_show_status(status)                                           \
+  __print_flags(status, "|", {0x0100, "RI"}, {0x0200, "VH"}, {0x0400, "VL"},   \
+                {0x0800, "VR"}, {0x1000, "HD"}, {0x2000, "SC"})
+
+/* One register block transfer, including failed attempts */
+TRACE_EVENT(max17048_reg_read,
+            TP_PROTO(const char *name, u8 reg, int count, int ret,
+                     u64 latency_ns),
+            TP_ARGS(name, reg, count, ret, latency_ns),
+            TP_STRUCT__entry(__string(name, name) __field(u8, reg)
+                                 __field(int, count) __field(int, ret)
+                                     __field(u64, latency_ns)),
+            TP_fast_assign(max17048_assign_str(name, name);
+                           __entry->reg = reg; __entry->count = count;
+                           __entry->ret = ret;
+                           __entry->latency_ns = latency_ns;),
+            TP_printk("%s reg=0x%02x count=%d ret=%d latency=%lluns",
+                      __get_str(name), __entry->reg, __entry->count,
+                      __entry->ret, __entry->latency_ns));
+
+/* A poll work burst refresh; ret 1 means served from last known good */
+TRACE_EVENT(max17048_refresh,
+            TP_PROTO(const char *name, bool wide, int ret, u64 duration_ns),
+            TP_ARGS(name, wide, ret, duration_ns),
+            TP_STRUCT__entry(__string(name, name) __field(bool, wide)
+                                 __field(int, ret) __field(u64, duration_ns)),
+            TP_fast_assign(max17048_assign_str(name, name);
+                           __entry->wide = wide; __entry->ret = ret;
+                           __entry->duration_ns = duration_ns;),
+            TP_printk("%s %s ret=%d duration=%lluns", __get_str(name),
+                      __entry->wide ? "wide" : "narrow", __entry->ret,
+                      __entry->duration_ns));
+
+/* A sample published to the history, learner and property readers */
+TRACE_EVENT(max17048_publish,
+            TP_PROTO(const char *name, int vcell_uv, int soc, int crate,
+                     u16 status),
+            TP_ARGS(name, vcell_uv, soc, crate, status),
+            TP_STRUCT__entry(__string(name, name) __field(int, vcell_uv)
+                                 __field(int, soc) __field(int, crate)
+                                     __field(u16, status)),
+            TP_fast_assign(max17048_assign_str(name, name);
+                           __entry->vcell_uv = vcell_uv; __entry->soc = soc;
+                           __entry->crate = crate; __entry->status = status;),
+            TP_printk("%s vcell=%duV soc=%d/256%% crate=%d status=%s",
+                      __get_str(name), __entry->vcell_uv, __entry->soc,
+                      __entry->crate, max17048_show_status(__entry->status)));
+
+/* The uevent decision of a poll */
+TRACE_EVENT(max17048_uevent,
+            TP_PROTO(const char *name, bool emitted, int soc, int status),
+            TP_ARGS(name, emitted, soc, status),
+            TP_STRUCT__entry(__string(name, name) __field(bool, emitted)
+                                 __field(int, soc) __field(int, status)),
+            TP_fast_assign(max17048_assign_str(name, name);
+                           __entry->emitted = emitted; __entry->soc = soc;
+                           __entry->status = status;),
+            TP_printk("%s %s soc=%d%% status=%d", __get_str(name),
+                      __entry->emitted ? "emitted" : "suppressed",
+                      __entry->soc, __entry->status));
+
+/* A battery property answered to userspace; string properties log 0 */
+TRACE_EVENT(max17048_property,
+            TP_PROTO(const char *name, int psp, int ret, int val),
+            TP_ARGS(name, psp, ret, val),
+            TP_STRUCT__entry(__string(name, name) __field(int, psp)
+                                 __field(int, ret) __field(int, val)),
+            TP_fast_assign(max17048_assign_str(name, name);
+                           __entry->psp = psp; __entry->ret = ret;
+                           __entry->val = val;),
+            TP_printk("%s psp=%d ret=%d val=%d", __get_str(name),
+                      __entry->psp, __entry->ret, __entry->val));
+
+/* The poll work rescheduled itself */
+TRACE_EVENT(max17048_poll,
+            TP_PROTO(const char *name, const char *reason,
+                     unsigned int delay_ms),
+            TP_ARGS(name, reason, delay_ms),
+            TP_STRUCT__entry(__string(name, name) __string(reason, reason)
+                                 __field(unsigned int, delay_ms)),
+            TP_fast_assign(max17048_assign_str(name, name);
+                           max17048_assign_str(reason, reason);
+                           __entry->delay_ms = delay_ms;),
+            TP_printk("%s %s delay=%ums", __get_str(name),
+                      __get_str(reason), __entry->delay_ms));
+
+/* ALRT interrupt with the decoded STATUS flags */
+TRACE_EVENT(max17048_alert,
+            TP_PROTO(const char *name, int ret, u16 status),
+            TP_ARGS(name, ret, status),
+            TP_STRUCT__entry(__string(name, name) __field(int, ret)
+                                 __field(u16, status)),
+            TP_fast_assign(max17048_assign_str(name, name);
+                           __entry->ret = ret; __entry->status = status;),
+            TP_printk("%s ret=%d status=%s", __get_str(name), __entry->ret,
+                      max17048_show_status(__entry->status)));
+
+#endif /* _MAX17048_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE max17048_trace
+#include <trace/define_trace.h>